@@ -0,0 +1,257 @@
+/*
+ * Control socket for k5start and krenew.
+ *
+ * When given a path with -C, k5start and krenew listen on a UNIX-domain
+ * socket there while running as a daemon or with a command.  Each connection
+ * carries a single request, a line naming the action, and receives a reply
+ * consisting of zero or more lines of the form "<key> <value>" followed by a
+ * final line that is either "ok" or "error" and a description of the error.
+ *
+ * This file only handles the socket itself: creating it, accepting and
+ * authenticating connections, reading requests, and sending replies.  The
+ * requests are interpreted by the framework.  Only connections from the user
+ * the program is running as and from root are accepted, which is checked
+ * with SO_PEERCRED or getpeereid.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#include <sys/un.h>
+
+#include <internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/*
+ * Some systems don't have MSG_NOSIGNAL.  Those that don't generally have
+ * SO_NOSIGPIPE instead, which is set on each client connection.
+ */
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/* How long to wait for a client to send its request, in seconds. */
+#define CONTROL_TIMEOUT 5
+
+
+/*
+ * Check whether the peer on the other end of a control connection is allowed
+ * to send requests.  Only root and the user we're running as are allowed.
+ * Reports the reason and returns false if the peer is rejected.
+ */
+static bool
+peer_allowed(int fd)
+{
+    uid_t uid;
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) < 0) {
+        syswarn("cannot get credentials of control connection peer");
+        return false;
+    }
+    uid = cred.uid;
+#elif defined(HAVE_GETPEEREID)
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) < 0) {
+        syswarn("cannot get credentials of control connection peer");
+        return false;
+    }
+#else
+    warn("cannot get credentials of control connection peer");
+    return false;
+#endif
+    if (uid != 0 && uid != geteuid()) {
+        warn("rejecting control connection from UID %lu",
+             (unsigned long) uid);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Create the control socket at the given path and start listening on it.
+ * Any existing socket at that path is assumed to be left over from a previous
+ * run and is removed; anything else there is an error.  The socket is only
+ * accessible by the user we're running as.  Returns the file descriptor of
+ * the socket or -1 on failure after reporting the error.
+ */
+int
+control_open(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int fd, status;
+
+#if !defined(SO_PEERCRED) && !defined(HAVE_GETPEEREID)
+    warn("control sockets are not supported on this platform");
+    return -1;
+#endif
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        warn("control socket path %s too long", path);
+        return -1;
+    }
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            warn("%s exists and is not a socket", path);
+            return -1;
+        }
+        if (unlink(path) < 0) {
+            syswarn("cannot remove old control socket %s", path);
+            return -1;
+        }
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        syswarn("cannot create control socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    mask = umask(077);
+    status = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (status < 0) {
+        syswarn("cannot bind control socket %s", path);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 5) < 0) {
+        syswarn("cannot listen on control socket %s", path);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+
+/*
+ * Accept a connection on the control socket and read its request into the
+ * provided buffer, without the trailing newline.  Returns the file
+ * descriptor of the client, to which the reply should be sent with
+ * control_reply and which the caller should then close, or -1 if there was
+ * no valid request.  The client is non-blocking once the request has been
+ * read, so that a client that stops reading its replies can't keep us from
+ * renewing tickets.
+ */
+int
+control_accept(int fd, char *request, size_t size)
+{
+    struct timeval timeout;
+    size_t length = 0;
+    ssize_t status;
+    int client;
+#ifdef SO_NOSIGPIPE
+    int on;
+#endif
+    char *end;
+
+    client = accept(fd, NULL, NULL);
+    if (client < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK
+            && errno != ECONNABORTED)
+            syswarn("cannot accept control connection");
+        return -1;
+    }
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    on = 1;
+    setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    if (!peer_allowed(client))
+        goto fail;
+
+    /* Don't let a stuck client keep us from renewing tickets. */
+    timeout.tv_sec = CONTROL_TIMEOUT;
+    timeout.tv_usec = 0;
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout)) < 0)
+        syswarn("cannot set timeout on control connection");
+
+    /* Read until the end of the first line or end of file. */
+    while (length < size - 1) {
+        status = read(client, request + length, size - 1 - length);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0) {
+            syswarn("cannot read control request");
+            goto fail;
+        }
+        if (status == 0)
+            break;
+        length += status;
+        if (memchr(request + length - status, '\n', status) != NULL)
+            break;
+    }
+    request[length] = '\0';
+    end = strchr(request, '\n');
+    if (end == NULL && length == size - 1) {
+        warn("control request too long");
+        goto fail;
+    }
+    if (end != NULL)
+        *end = '\0';
+    end = strchr(request, '\r');
+    if (end != NULL)
+        *end = '\0';
+    if (request[0] == '\0')
+        goto fail;
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    return client;
+
+fail:
+    close(client);
+    return -1;
+}
+
+
+/*
+ * Send part of a reply to a control client, formatted as with printf.
+ * Returns 0 on success and -1 if the reply couldn't be sent, which generally
+ * means that the client has gone away or isn't reading what we send, since
+ * the client is non-blocking.  Errors aren't reported, since that shouldn't
+ * affect anything else we're doing.
+ */
+int
+control_reply(int client, const char *format, ...)
+{
+    va_list args;
+    char *reply;
+    size_t length, offset = 0;
+    ssize_t status;
+
+    va_start(args, format);
+    xvasprintf(&reply, format, args);
+    va_end(args);
+    length = strlen(reply);
+    while (offset < length) {
+        status = send(client, reply + offset, length - offset, MSG_NOSIGNAL);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            break;
+        offset += status;
+    }
+    free(reply);
+    return (offset < length) ? -1 : 0;
+}
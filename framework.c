@@ -33,10 +33,29 @@
 #include <portable/system.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_LINUX_KEYCTL_H
+# include <linux/keyctl.h>
+#endif
 #include <signal.h>
+#ifdef HAVE_FLOCK
+# include <sys/file.h>
+#endif
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef HAVE_LINUX_KEYCTL_H
+# include <sys/syscall.h>
+#endif
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
+#ifdef HAVE_SYS_VFS_H
+# include <sys/vfs.h>
+#endif
+#include <sys/wait.h>
 #include <time.h>
 
 #include <internal.h>
@@ -53,6 +72,81 @@
  */
 #define EXPIRE_FUDGE (2 * 60)
 
+/*
+ * With -R, how long the command has to keep running before its earlier
+ * failures are forgotten, and the longest we wait before restarting it, both
+ * in seconds.
+ */
+#define RESTART_RESET (10 * 60)
+#define RESTART_MAX_DELAY 60
+
+/*
+ * Each refresh while running as a daemon gets a time budget, which is the
+ * remaining lifetime of the tickets capped at the interval between checks
+ * but at least BUDGET_MIN seconds.  The first BUDGET_KDC percent of it may be
+ * spent talking to the KDC, and aklog gets whatever is left.  Time spent
+ * waiting for the -W lock isn't counted.
+ */
+#define BUDGET_MIN 60
+#define BUDGET_KDC 75
+
+/*
+ * How often to check whether the process we're replacing with -E replace has
+ * released the PID file, in milliseconds.
+ */
+#define PIDFILE_POLL 100
+
+/*
+ * Whether the lock on the PID file belongs to the open file, in which case
+ * it survives backgrounding.  Otherwise, it's only taken by the child
+ * process.
+ */
+#if defined(HAVE_FLOCK) || defined(F_OFD_SETLK)
+# define PIDFILE_LOCK_INHERITED 1
+#else
+# define PIDFILE_LOCK_INHERITED 0
+#endif
+
+/*
+ * The environment variable used to pass our state to the new binary when
+ * re-executing ourselves on SIGUSR2.  Its value is the time of the last
+ * successful refresh, the number of commands, then for each command its PID
+ * (0 if waiting to restart it and -1 if it's done) and our end of its -N
+ * pipe socket (or -1), and finally the ticket cache, separated by spaces.
+ */
+#define UPGRADE_ENV "KSTART_UPGRADE"
+
+/* Some systems don't have MSG_NOSIGNAL but have SO_NOSIGPIPE instead. */
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * Stores into the generation file, which other processes read concurrently.
+ * The 64-bit fields must not tear, and the generation is stored with release
+ * semantics so that a reader that loads it with acquire semantics also sees
+ * the times stored before it.  Fall back on a full barrier and plain stores
+ * where 64-bit atomics aren't available.
+ */
+#if defined(__GCC_ATOMIC_LLONG_LOCK_FREE) && __GCC_ATOMIC_LLONG_LOCK_FREE == 2
+# define GENERATION_STORE(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+# define GENERATION_PUBLISH(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#elif defined(__GNUC__)
+# define GENERATION_STORE(p, v)   (*(p) = (v))
+# define GENERATION_PUBLISH(p, v) (__sync_synchronize(), *(p) = (v))
+#else
+# define GENERATION_STORE(p, v)   (*(p) = (v))
+# define GENERATION_PUBLISH(p, v) (*(p) = (v))
+#endif
+
+/* Linux file system magic numbers for memory-backed file systems. */
+#ifndef TMPFS_MAGIC
+# define TMPFS_MAGIC 0x01021994
+#endif
+#ifndef RAMFS_MAGIC
+# define RAMFS_MAGIC 0x858458f6
+#endif
+
 /*
  * Set when the program receives SIGALRM, which indicates that it should wake
  * up immediately and reauthenticate.
@@ -60,203 +154,1934 @@
 static volatile sig_atomic_t alarm_signaled = 0;
 
 /*
- * Set when the program receives SIGHUP or SIGTERM to do cleanup and exit.
- * These signal handlers are only used when we're not running a command, since
- * running a command provides its own signal handlers.
+ * Set when the program receives SIGHUP or SIGTERM to do cleanup and exit.
+ * These signal handlers are only used when we're not running a command, since
+ * running a command provides its own signal handlers.
+ */
+static volatile sig_atomic_t exit_signaled = 0;
+
+/*
+ * Set when the program receives SIGUSR2, which indicates that it should
+ * re-execute itself, normally to switch to a newly installed binary.
+ */
+static volatile sig_atomic_t upgrade_signaled = 0;
+
+/* The scheduler state, which is saved in the state file if -j was given. */
+static struct state state;
+
+/* The listening control socket if -C was given, or -1. */
+static int control_fd = -1;
+
+/*
+ * The refresh generation, which is mapped from the generation file if -G was
+ * given and otherwise only kept in memory, and the control connections that
+ * are waiting to be told about each new generation.
+ */
+static struct generation generation_memory;
+static volatile struct generation *generation = &generation_memory;
+static int *watchers = NULL;
+static size_t nwatchers = 0;
+
+/* The maximum number of control connections that can watch for refreshes. */
+#define MAX_WATCHERS 64
+
+/*
+ * How often to ping the systemd watchdog in seconds, or 0 if it's not
+ * enabled, and when the next ping is due.
+ */
+static time_t watchdog_interval = 0;
+static time_t watchdog_next = 0;
+
+/*
+ * The open descriptor for the PID file, on which we hold an exclusive lock
+ * for as long as we're running, or -1 if we don't hold the PID file.
+ */
+static int pidfile_fd = -1;
+
+/*
+ * Whether to give AFS tokens directly to the Linux kernel AFS client instead
+ * of running aklog, which we do if it's the AFS client on this system and
+ * AKLOG wasn't set.
+ */
+static bool afs_rxrpc = false;
+
+/*
+ * The session keyrings of other processes registered on the control socket
+ * that should also get the AFS tokens, and the maximum number of them.
+ */
+static long *pags = NULL;
+static size_t npags = 0;
+#define MAX_PAGS 256
+
+/*
+ * The exit status of the last run of aklog, or -1 if it failed or was
+ * killed, and how long it took in milliseconds, for the control socket.
+ */
+static bool aklog_ran = false;
+static int aklog_status = 0;
+static unsigned long aklog_duration = 0;
+
+/*
+ * When the time budget of the current refresh runs out and when its share
+ * for talking to the KDC runs out, or 0 if there is no limit, and whether
+ * getting an AFS token was cut short by running out of time and should be
+ * retried at the next wakeup.
+ */
+static time_t cycle_end = 0;
+static time_t cycle_kdc = 0;
+static bool token_pending = false;
+
+
+/*
+ * The environment variable that tells the command which file descriptor to
+ * read refresh notifications from with -N pipe.
+ */
+#define NOTIFY_ENV "KSTART_NOTIFY_FD"
+
+/* Signals that can be given by name to -N, without the SIG prefix. */
+static const struct {
+    const char *name;
+    int number;
+} signal_names[] = {
+    { "HUP",   SIGHUP   },
+    { "INT",   SIGINT   },
+    { "QUIT",  SIGQUIT  },
+    { "ALRM",  SIGALRM  },
+    { "TERM",  SIGTERM  },
+    { "USR1",  SIGUSR1  },
+    { "USR2",  SIGUSR2  },
+    { "CONT",  SIGCONT  },
+    { "WINCH", SIGWINCH },
+    { NULL,    0        }
+};
+
+
+/*
+ * Convert from a string to a number, checking errors, and return -1 on any
+ * error or for any negative number.  This doesn't really belong here, but
+ * it's a tiny function used by both k5start and krenew.
+ */
+long
+convert_number(const char *string, int base)
+{
+    long number;
+    char *end;
+
+    errno = 0;
+    number = strtol(string, &end, base);
+    if (errno != 0 || *end != '\0')
+        return -1;
+    return number;
+}
+
+
+/*
+ * Convert from a string to a sync policy, storing it in the second argument.
+ * Returns false if the string isn't a known policy.
+ */
+bool
+convert_sync_policy(const char *string, enum sync_policy *policy)
+{
+    if (strcmp(string, "none") == 0)
+        *policy = SYNC_NONE;
+    else if (strcmp(string, "data") == 0)
+        *policy = SYNC_DATA;
+    else if (strcmp(string, "full") == 0)
+        *policy = SYNC_FULL;
+    else
+        return false;
+    return true;
+}
+
+
+/*
+ * Convert from a string to a private ticket cache type, storing it in the
+ * second argument.  Returns false if the string isn't a known type.
+ */
+bool
+convert_private_cache(const char *string, enum private_cache *type)
+{
+    if (strcmp(string, "file") == 0)
+        *type = PRIVATE_FILE;
+    else if (strcmp(string, "tmpfs") == 0)
+        *type = PRIVATE_TMPFS;
+    else if (strcmp(string, "keyring") == 0)
+        *type = PRIVATE_KEYRING;
+    else
+        return false;
+    return true;
+}
+
+
+/*
+ * Convert from a string to the action to take if the PID file is already
+ * held by another process, storing it in the second argument.  Returns false
+ * if the string isn't a known action.
+ */
+bool
+convert_pidfile_action(const char *string, enum pidfile_action *action)
+{
+    if (strcmp(string, "refuse") == 0)
+        *action = PIDFILE_REFUSE;
+    else if (strcmp(string, "replace") == 0)
+        *action = PIDFILE_REPLACE;
+    else
+        return false;
+    return true;
+}
+
+
+/*
+ * Convert from a string to the way to notify the command about refreshed
+ * tickets, storing it in the second argument and, if it's a signal, the
+ * signal number in the third argument.  The string is either "pipe" or a
+ * signal, given by name with or without the SIG prefix or by number.
+ * Returns false if the string isn't valid.
+ */
+bool
+convert_notify(const char *string, enum notify_method *method, int *signal)
+{
+    long number;
+    size_t i;
+
+    if (strcmp(string, "pipe") == 0) {
+        *method = NOTIFY_PIPE;
+        return true;
+    }
+    if (strncmp(string, "SIG", 3) == 0)
+        string += 3;
+    for (i = 0; signal_names[i].name != NULL; i++)
+        if (strcmp(string, signal_names[i].name) == 0) {
+            *method = NOTIFY_SIGNAL;
+            *signal = signal_names[i].number;
+            return true;
+        }
+    number = convert_number(string, 10);
+    if (number <= 0 || number >= NSIG)
+        return false;
+    *method = NOTIFY_SIGNAL;
+    *signal = number;
+    return true;
+}
+
+
+/*
+ * Convert from a string to a policy for when to stop running several
+ * commands, storing it in the second argument.  Returns false if the string
+ * isn't a known policy.
+ */
+bool
+convert_wait_policy(const char *string, enum wait_policy *policy)
+{
+    if (strcmp(string, "any") == 0)
+        *policy = WAIT_FOR_ANY;
+    else if (strcmp(string, "all") == 0)
+        *policy = WAIT_FOR_ALL;
+    else
+        return false;
+    return true;
+}
+
+
+/*
+ * Add a command to run, given as a NULL-terminated argument vector.  The
+ * positional command is added first so that it's the one the -c PID file is
+ * for, and config->command always points to the first command so that the
+ * rest of the code can check whether there are any commands.
+ */
+void
+add_command(struct config *config, char **argv, bool first)
+{
+    struct command *command;
+    size_t n = config->ncommands;
+
+    config->commands
+        = xreallocarray(config->commands, n + 1, sizeof(struct command));
+    if (first) {
+        memmove(&config->commands[1], &config->commands[0],
+                n * sizeof(struct command));
+        command = &config->commands[0];
+    } else
+        command = &config->commands[n];
+    memset(command, 0, sizeof(struct command));
+    command->argv = argv;
+    command->notify_fd = -1;
+    command->delay = 1;
+    config->ncommands++;
+    config->command = config->commands[0].argv;
+}
+
+
+/*
+ * Add a command line given with -A, which is run with /bin/sh -c so that it
+ * can contain arguments and shell syntax.
+ */
+void
+add_shell_command(struct config *config, const char *command)
+{
+    char **argv;
+
+    argv = xcalloc(4, sizeof(char *));
+    argv[0] = xstrdup("/bin/sh");
+    argv[1] = xstrdup("-c");
+    argv[2] = xstrdup(command);
+    add_command(config, argv, false);
+}
+
+
+/*
+ * Return true if the given directory is on a memory-backed file system.  We
+ * can only check this on Linux.  Elsewhere, assume that the directories we
+ * try are memory-backed if they exist.
+ */
+static bool
+memory_backed(const char *dir)
+{
+#if defined(HAVE_SYS_VFS_H) && defined(__linux__)
+    struct statfs st;
+
+    if (statfs(dir, &st) < 0)
+        return false;
+    return (st.f_type == TMPFS_MAGIC || st.f_type == RAMFS_MAGIC);
+#else
+    struct stat st;
+
+    return (stat(dir, &st) == 0 && S_ISDIR(st.st_mode));
+#endif
+}
+
+
+/*
+ * Find a directory on a memory-backed file system that we can use for a
+ * private ticket cache.  Prefer the per-user runtime directory, since it's
+ * private to the user, and otherwise use the shared memory directory.
+ * Returns NULL if none could be found.
+ */
+static const char *
+memory_directory(void)
+{
+    const char *dir;
+
+    dir = getenv("XDG_RUNTIME_DIR");
+    if (dir != NULL && dir[0] == '/' && memory_backed(dir)
+        && access(dir, W_OK | X_OK) == 0)
+        return dir;
+    if (memory_backed("/dev/shm") && access("/dev/shm", W_OK | X_OK) == 0)
+        return "/dev/shm";
+    if (memory_backed("/run/shm") && access("/run/shm", W_OK | X_OK) == 0)
+        return "/run/shm";
+    return NULL;
+}
+
+
+/*
+ * Join a new, anonymous session keyring and return the name of a keyring
+ * ticket cache in it.  The keyring is inherited by the command and by aklog
+ * and is private to them, and the kernel discards it when the last process
+ * using it exits, so the credentials never touch the file system.  Dies if
+ * this isn't supported.
+ */
+static char *
+keyring_cache_create(void)
+{
+    char *cache;
+
+#if defined(HAVE_LINUX_KEYCTL_H) && defined(SYS_keyctl)
+    if (syscall(SYS_keyctl, KEYCTL_JOIN_SESSION_KEYRING, NULL) < 0)
+        sysdie("cannot create session keyring");
+    xasprintf(&cache, "KEYRING:session:krb5cc_%d", (int) getuid());
+#else
+    cache = NULL;
+    die("keyring ticket caches are not supported on this system");
+#endif
+    return cache;
+}
+
+
+/*
+ * Create the private ticket cache used when running a command.  By default,
+ * this is a mkstemp-generated file in /tmp, but it can be put on a
+ * memory-backed file system or in a new session keyring so that ticket cache
+ * I/O never touches a disk.  The cache is destroyed on exit by exit_cleanup
+ * via clean_cache.
+ */
+char *
+private_cache_create(enum private_cache type)
+{
+    const char *dir = "/tmp";
+    char *tmp, *cache;
+    int fd;
+
+    if (type == PRIVATE_KEYRING)
+        return keyring_cache_create();
+    if (type == PRIVATE_TMPFS) {
+        dir = memory_directory();
+        if (dir == NULL)
+            die("cannot find a memory-backed directory for the ticket cache");
+    }
+    xasprintf(&tmp, "%s/krb5cc_%d_XXXXXX", dir, (int) getuid());
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        sysdie("cannot create ticket cache file");
+    if (fchmod(fd, 0600) < 0)
+        sysdie("cannot chmod ticket cache file");
+    close(fd);
+    xasprintf(&cache, "FILE:%s", tmp);
+    free(tmp);
+    return cache;
+}
+
+
+/*
+ * Return the path to the file behind a ticket cache name, or NULL if the
+ * cache isn't a file cache.  A name without a leading all-uppercase type
+ * followed by a colon is a path.
+ */
+const char *
+cache_path(const char *cache)
+{
+    const char *p;
+
+    if (strncmp(cache, "FILE:", strlen("FILE:")) == 0)
+        return cache + strlen("FILE:");
+    if (strncmp(cache, "WRFILE:", strlen("WRFILE:")) == 0)
+        return cache + strlen("WRFILE:");
+    for (p = cache; *p != '\0'; p++) {
+        if (p > cache && *p == ':')
+            return NULL;
+        else if (*p < 'A' || *p > 'Z')
+            return cache;
+    }
+    return cache;
+}
+
+
+/*
+ * Flush the data of a ticket cache file to disk if the sync policy says to.
+ */
+void
+sync_cache_file(struct config *config, const char *cache)
+{
+    const char *path;
+    int fd, status;
+
+    if (config->sync == SYNC_NONE)
+        return;
+    path = cache_path(cache);
+    if (path == NULL)
+        return;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        syswarn("cannot open ticket cache %s to flush it", path);
+        return;
+    }
+#ifdef HAVE_FDATASYNC
+    status = fdatasync(fd);
+#else
+    status = fsync(fd);
+#endif
+    if (status < 0)
+        syswarn("cannot flush ticket cache %s", path);
+    close(fd);
+}
+
+
+/*
+ * Flush the directory containing a ticket cache file if the sync policy says
+ * to, so that a newly created or renamed cache survives a crash.
+ */
+void
+sync_cache_dir(struct config *config, const char *cache)
+{
+    const char *path, *p;
+    char *dir;
+    int fd;
+
+    if (config->sync != SYNC_FULL)
+        return;
+    path = cache_path(cache);
+    if (path == NULL)
+        return;
+    p = strrchr(path, '/');
+    if (p == NULL)
+        dir = xstrdup(".");
+    else if (p == path)
+        dir = xstrdup("/");
+    else
+        dir = xstrndup(path, p - path);
+    fd = open(dir, O_RDONLY);
+    if (fd < 0) {
+        syswarn("cannot open directory %s to flush it", dir);
+        free(dir);
+        return;
+    }
+    if (fsync(fd) < 0)
+        syswarn("cannot flush directory %s", dir);
+    close(fd);
+    free(dir);
+}
+
+
+/*
+ * Report the time taken by a ticket cache write when verbose.  This is meant
+ * to help choose the cheapest sync policy that's safe for a given system.
+ */
+void
+report_cache_write(struct config *config, const struct timeval *start)
+{
+    struct timeval now;
+    long elapsed;
+
+    if (!config->verbose)
+        return;
+    gettimeofday(&now, NULL);
+    elapsed = (now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_usec - start->tv_usec) / 1000;
+    notice("ticket cache written in %ld ms", elapsed);
+}
+
+
+/*
+ * Signal handler for SIGALRM.  Just sets the global sentinel variable.
+ */
+static void
+alarm_handler(int s UNUSED)
+{
+    alarm_signaled = 1;
+}
+
+
+/*
+ * Signal handler for SIGHUP and SIGTERM.  Just sets the global sentinel
+ * variable.
+ */
+static void
+exit_handler(int s UNUSED)
+{
+    exit_signaled = 1;
+}
+
+
+/*
+ * Signal handler for SIGUSR2.  Just sets the global sentinel variable.
+ */
+static void
+upgrade_handler(int s UNUSED)
+{
+    upgrade_signaled = 1;
+}
+
+
+/*
+ * Parse the state passed to us in the environment by the previous binary if
+ * we were started by a re-exec upgrade.  Returns false if we weren't, and
+ * otherwise returns true and stores the time of the last successful refresh
+ * and, if cache isn't NULL, the ticket cache in the arguments.  If config
+ * isn't NULL, also stores the PID and notification descriptor of each
+ * command in config->commands, provided that the number of commands matches.
+ */
+static bool
+upgrade_state(struct config *config, time_t *refreshed, const char **cache)
+{
+    const char *value;
+    unsigned long when, count, i;
+    long pid;
+    int fd;
+    int offset = 0;
+
+    value = getenv(UPGRADE_ENV);
+    if (value == NULL)
+        return false;
+    if (sscanf(value, "%lu %lu %n", &when, &count, &offset) < 2
+        || offset == 0)
+        return false;
+    if (config != NULL && count != config->ncommands)
+        return false;
+    value += offset;
+    for (i = 0; i < count; i++) {
+        offset = 0;
+        if (sscanf(value, "%ld %d %n", &pid, &fd, &offset) < 2 || offset == 0)
+            return false;
+        value += offset;
+        if (config != NULL) {
+            config->commands[i].pid = (pid > 0) ? pid : 0;
+            config->commands[i].done = (pid < 0);
+            config->commands[i].started = (pid != 0) ? time(NULL) : 0;
+            config->commands[i].notify_fd = fd;
+        }
+    }
+    if (value[0] == '\0')
+        return false;
+    *refreshed = when;
+    if (cache != NULL)
+        *cache = value;
+    return true;
+}
+
+
+/*
+ * If we were started by a re-exec upgrade, return the ticket cache that the
+ * previous binary was maintaining in newly allocated memory, and otherwise
+ * NULL.  k5start and krenew use this to keep using the private ticket cache
+ * of a running command rather than creating a new one.
+ */
+char *
+upgrade_cache(void)
+{
+    time_t refreshed;
+    const char *cache;
+
+    if (!upgrade_state(NULL, &refreshed, &cache))
+        return NULL;
+    return xstrdup(cache);
+}
+
+
+/*
+ * Re-execute ourselves with the same arguments so that a newly installed
+ * binary takes over without disturbing the running commands.  The commands
+ * remain our children and stay in their PAG since the process doesn't
+ * change.  Pass the state the new binary needs to resume in the environment.
+ * If the exec fails, report that and keep running.
+ */
+static void
+upgrade(struct config *config)
+{
+    struct command *command;
+    char *value, *next;
+    long pid;
+    size_t i;
+
+    if (config->argv == NULL)
+        return;
+    xasprintf(&value, "%lu %lu", (unsigned long) state.refreshed,
+              (unsigned long) config->ncommands);
+    for (i = 0; i < config->ncommands; i++) {
+        command = &config->commands[i];
+        pid = command->done ? -1 : (long) command->pid;
+        xasprintf(&next, "%s %ld %d", value, pid, command->notify_fd);
+        free(value);
+        value = next;
+    }
+    xasprintf(&next, "%s %s", value, config->cache);
+    free(value);
+    value = next;
+    if (setenv(UPGRADE_ENV, value, 1) != 0) {
+        syswarn("cannot set %s environment variable", UPGRADE_ENV);
+        free(value);
+        return;
+    }
+    free(value);
+    if (!systemd_export()) {
+        unsetenv(UPGRADE_ENV);
+        return;
+    }
+    if (config->verbose)
+        notice("re-executing %s", config->argv[0]);
+    fflush(stdout);
+    for (i = 0; i < config->ncommands; i++)
+        if (config->commands[i].notify_fd >= 0)
+            fcntl(config->commands[i].notify_fd, F_SETFD, 0);
+    execvp(config->argv[0], config->argv);
+    syswarn("cannot re-execute %s", config->argv[0]);
+    for (i = 0; i < config->ncommands; i++)
+        if (config->commands[i].notify_fd >= 0)
+            fcntl(config->commands[i].notify_fd, F_SETFD, FD_CLOEXEC);
+    unsetenv(UPGRADE_ENV);
+    systemd_init();
+}
+
+
+/*
+ * Get the principal name for the krbtgt ticket for the local realm.  The
+ * caller is responsible for freeing the principal.  Takes an existing
+ * principal to get the realm from and returns a Kerberos error on failure.
+ */
+static krb5_error_code
+get_krbtgt_princ(krb5_context ctx, krb5_principal user, krb5_principal *princ)
+{
+    const char *realm;
+
+    realm = krb5_principal_get_realm(ctx, user);
+    if (realm == NULL)
+        return KRB5_CONFIG_NODEFREALM;
+    return krb5_build_principal(ctx, princ, strlen(realm), realm, "krbtgt",
+                                realm, (const char *) NULL);
+}
+
+
+/*
+ * Find the ticket-granting ticket in the ticket cache, for the configured
+ * client principal if there is one and otherwise for the default principal
+ * of the cache.  Stores the credentials, which the caller must free with
+ * krb5_free_creds, in the last argument and returns a Kerberos status code.
+ */
+static krb5_error_code
+find_tgt(krb5_context ctx, struct config *config, krb5_creds **outcreds)
+{
+    krb5_ccache ccache = NULL;
+    krb5_creds increds;
+    bool increds_valid = false;
+    krb5_error_code code;
+
+    *outcreds = NULL;
+    memset(&increds, 0, sizeof(increds));
+    code = krb5_cc_resolve(ctx, config->cache, &ccache);
+    if (code != 0)
+        goto done;
+    if (config->client != NULL)
+        increds.client = config->client;
+    else {
+        code = krb5_cc_get_principal(ctx, ccache, &increds.client);
+        if (code != 0)
+            goto done;
+    }
+    code = get_krbtgt_princ(ctx, increds.client, &increds.server);
+    if (code != 0)
+        goto done;
+    code = krb5_get_credentials(ctx, 0, ccache, &increds, outcreds);
+    if (code != 0)
+        goto done;
+    increds_valid = true;
+
+done:
+    if (increds.client == config->client)
+        increds.client = NULL;
+    if (ccache != NULL)
+        krb5_cc_close(ctx, ccache);
+    if (increds_valid)
+        krb5_free_cred_contents(ctx, &increds);
+    else {
+        if (increds.client != NULL)
+            krb5_free_principal(ctx, increds.client);
+        if (increds.server != NULL)
+            krb5_free_principal(ctx, increds.server);
+    }
+    return code;
+}
+
+
+/*
+ * Check whether a ticket will expire within the given number of minutes.
+ * Takes the cache and the number of minutes.  Returns a Kerberos status code
+ * which will be 0 if the ticket won't expire, KRB5KRB_AP_ERR_TKT_EXPIRED if
+ * it will expire and can be renewed, or another error code for any other
+ * situation.
+ *
+ * Don't report any errors here, since k5start doesn't want to warn about any
+ * of these problems.  Just return the status code.  krenew will separately
+ * report an error if appropriate.
+ */
+static krb5_error_code
+ticket_expired(krb5_context ctx, struct config *config)
+{
+    krb5_creds *outcreds;
+    time_t now, then, offset;
+    krb5_error_code code;
+
+    /* Obtain the ticket. */
+    code = find_tgt(ctx, config, &outcreds);
+
+    /* Check the expiration time and renewal limit. */
+    if (code == 0) {
+        now = time(NULL);
+        then = outcreds->times.endtime;
+        if (config->happy_ticket > 0)
+            offset = 60 * (config->keep_ticket + config->happy_ticket);
+        else
+            offset = 60 * config->keep_ticket + EXPIRE_FUDGE;
+        if (then < now + offset)
+            code = KRB5KRB_AP_ERR_TKT_EXPIRED;
+
+        /*
+         * The error code for an inability to renew the ticket for long enough
+         * is arbitrary.  It just needs to be different than the error code
+         * that indicates we can renew the ticket and coordinated with the
+         * check in krenew's authentication callback.
+         *
+         * If the ticket is not going to expire, we skip this check.
+         * Otherwise, krenew -H 1 would fail even if the ticket had plenty of
+         * remaining lifespan if it was not renewable.
+         */
+        if (code == KRB5KRB_AP_ERR_TKT_EXPIRED) {
+            then = outcreds->times.renew_till;
+            if (then < now + offset)
+                code = KRB5KDC_ERR_KEY_EXP;
+        }
+    }
+    if (outcreds != NULL)
+        krb5_free_creds(ctx, outcreds);
+    return code;
+}
+
+
+/*
+ * Start a refresh while running as a daemon, setting its time budget from the
+ * remaining lifetime of the tickets and telling the KDC hooks when to stop
+ * sending requests.  If the tickets have already expired, the refresh only
+ * gets the minimum budget and is retried at the next wakeup if that isn't
+ * enough.
+ */
+static void
+cycle_start(krb5_context ctx, struct config *config)
+{
+    krb5_creds *creds;
+    time_t now, budget = 0;
+
+    now = time(NULL);
+    if (find_tgt(ctx, config, &creds) == 0 && creds->times.endtime > now)
+        budget = creds->times.endtime - now;
+    if (creds != NULL)
+        krb5_free_creds(ctx, creds);
+    if (budget > config->keep_ticket * 60)
+        budget = config->keep_ticket * 60;
+    if (budget < BUDGET_MIN)
+        budget = BUDGET_MIN;
+    cycle_end = now + budget;
+    cycle_kdc = now + budget * BUDGET_KDC / 100;
+    kdc_deadline(cycle_kdc);
+}
+
+
+/*
+ * Finish a refresh, removing its time limits.
+ */
+static void
+cycle_finish(void)
+{
+    cycle_end = 0;
+    cycle_kdc = 0;
+    kdc_deadline(0);
+}
+
+
+/*
+ * Move the time limits of the current refresh, if any, later by the given
+ * number of seconds, so that time spent waiting doesn't count against it.
+ */
+static void
+cycle_delay(time_t waited)
+{
+    if (cycle_end == 0 || waited <= 0)
+        return;
+    cycle_end += waited;
+    cycle_kdc += waited;
+    kdc_deadline(cycle_kdc);
+}
+
+
+/*
+ * Stop sending refresh notifications to the watcher at the given index in
+ * the watchers array and close its connection.
+ */
+static void
+remove_watcher(size_t i)
+{
+    close(watchers[i]);
+    watchers[i] = watchers[nwatchers - 1];
+    nwatchers--;
+}
+
+
+/*
+ * Announce that the ticket cache has been refreshed by incrementing the
+ * generation, after first storing the times of this refresh, and telling
+ * every control connection watching for refreshes about the new generation.
+ * We're the only writer, so the increment needn't be atomic, only the store
+ * that publishes it.  Watchers that have gone away or that have stopped
+ * reading, so that the notification can't be sent without blocking, are
+ * dropped.
+ */
+static void
+announce_refresh(void)
+{
+    size_t i;
+    uint64_t current;
+
+    GENERATION_STORE(&generation->refreshed, (uint64_t) state.refreshed);
+    GENERATION_STORE(&generation->expires, (uint64_t) state.expires);
+    current = generation->generation + 1;
+    GENERATION_PUBLISH(&generation->generation, current);
+    i = 0;
+    while (i < nwatchers) {
+        if (control_reply(watchers[i], "generation %lu\n",
+                          (unsigned long) current) < 0)
+            remove_watcher(i);
+        else
+            i++;
+    }
+}
+
+
+/*
+ * Record the result of an authentication or renewal and, if -j was given,
+ * save it in the state file.  On success, note when the ticket cache was
+ * refreshed and when its tickets expire and announce the new generation; on
+ * failure, count the failure and keep the rest.
+ */
+static void
+record_state(krb5_context ctx, struct config *config, krb5_error_code status)
+{
+    krb5_creds *creds;
+    krb5_error_code code;
+    char *principal;
+
+    if (status == 0) {
+        state.refreshed = time(NULL);
+        state.failures = 0;
+        if (find_tgt(ctx, config, &creds) == 0) {
+            state.expires = creds->times.endtime;
+            code = krb5_unparse_name(ctx, creds->client, &principal);
+            if (code == 0) {
+                free(state.principal);
+                state.principal = xstrdup(principal);
+                krb5_free_unparsed_name(ctx, principal);
+            }
+            krb5_free_creds(ctx, creds);
+        }
+        announce_refresh();
+    } else
+        state.failures++;
+    state.status = status;
+    if (config->statefile == NULL)
+        return;
+    if (state.cache == NULL)
+        state.cache = xstrdup(config->cache);
+    if (state.principal != NULL)
+        state_write(config->statefile, &state);
+}
+
+
+/*
+ * Decide on startup whether the existing ticket cache can be trusted instead
+ * of authenticating again, based on the state file given with -j.  It can if
+ * the state file is for the same ticket cache, the cache still holds tickets
+ * for the principal recorded there, and those tickets aren't about to expire.
+ * In that case, keep the saved state so that the schedule can pick up where
+ * it left off and return true.  Otherwise, if the state file is for the same
+ * ticket cache, still keep its count of consecutive failures and its
+ * principal so that the retry backoff continues from where it was and
+ * further failures are recorded.
+ */
+static bool
+resume_state(krb5_context ctx, struct config *config)
+{
+    struct state saved;
+    krb5_creds *creds;
+    krb5_error_code code;
+    const char *old, *new;
+    char *principal = NULL;
+    bool okay = false;
+
+    if (config->statefile == NULL)
+        return false;
+    if (!state_read(config->statefile, &saved))
+        return false;
+
+    /* Compare file caches by path, ignoring any FILE: prefix. */
+    old = cache_path(saved.cache);
+    new = cache_path(config->cache);
+    if (old == NULL || new == NULL) {
+        old = saved.cache;
+        new = config->cache;
+    }
+    if (strcmp(old, new) != 0)
+        goto done;
+    state.failures = saved.failures;
+    if (state.principal == NULL)
+        state.principal = xstrdup(saved.principal);
+    if (find_tgt(ctx, config, &creds) != 0)
+        goto done;
+    code = krb5_unparse_name(ctx, creds->client, &principal);
+    krb5_free_creds(ctx, creds);
+    if (code != 0 || strcmp(principal, saved.principal) != 0)
+        goto done;
+    if (ticket_expired(ctx, config) != 0)
+        goto done;
+    okay = true;
+
+done:
+    if (principal != NULL)
+        krb5_free_unparsed_name(ctx, principal);
+    if (okay) {
+        if (config->verbose)
+            notice("ticket cache %s is still valid, not refreshing",
+                   config->cache);
+        free(state.principal);
+        state = saved;
+    } else
+        state_free(&saved);
+    return okay;
+}
+
+
+/*
+ * Take an exclusive lock on an open file, waiting until it's available.  Use
+ * flock where available, since it only needs the file to be open for
+ * reading, and otherwise fall back on fcntl, which needs it to be open for
+ * writing.
+ */
+static int
+lock_file(int fd)
+{
+#ifdef HAVE_FLOCK
+    return flock(fd, LOCK_EX);
+#else
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    return fcntl(fd, F_SETLKW, &lock);
+#endif
+}
+
+
+/*
+ * Authenticate or renew, given the status from ticket_expired or 0 to always
+ * do so.  If -W was given, first take an exclusive lock on the lock file for
+ * the ticket cache so that only one of several k5start or krenew processes
+ * sharing a ticket cache refreshes it at a time.  Once we have the lock, if
+ * we were only refreshing the ticket because it was about to expire, check
+ * it again, since another process may have refreshed it while we waited.
+ * The wait isn't counted against the time budget of the refresh.
+ *
+ * Failing to open or lock the lock file is reported but otherwise ignored,
+ * since the lock only avoids redundant work.
+ */
+static krb5_error_code
+locked_auth(krb5_context ctx, struct config *config, krb5_error_code status)
+{
+    krb5_error_code code;
+    time_t start;
+    int fd;
+
+    if (config->lockfile == NULL) {
+        code = config->auth(ctx, config, status);
+        record_state(ctx, config, code);
+        return code;
+    }
+    fd = open(config->lockfile, O_RDWR | O_CREAT, 0644);
+#ifdef HAVE_FLOCK
+    if (fd < 0 && errno == EACCES)
+        fd = open(config->lockfile, O_RDONLY);
+#endif
+    if (fd < 0) {
+        syswarn("cannot open lock file %s", config->lockfile);
+        code = config->auth(ctx, config, status);
+        record_state(ctx, config, code);
+        return code;
+    }
+    start = time(NULL);
+    while (lock_file(fd) < 0) {
+        if (errno != EINTR) {
+            syswarn("cannot lock %s", config->lockfile);
+            break;
+        }
+        if (exit_signaled) {
+            close(fd);
+            exit_cleanup(ctx, config, 0);
+        }
+    }
+    cycle_delay(time(NULL) - start);
+    if (status != 0) {
+        status = ticket_expired(ctx, config);
+        if (status == 0) {
+            if (config->verbose)
+                notice("ticket cache was refreshed by another process");
+            close(fd);
+            record_state(ctx, config, 0);
+            return 0;
+        }
+    }
+    code = config->auth(ctx, config, status);
+    close(fd);
+    record_state(ctx, config, code);
+    return code;
+}
+
+
+/*
+ * Retry the initial authentication when the program is first starting.  Retry
+ * the authentication immediately, then after one second, and keep trying with
+ * exponential backoff, maxing out at one minute and continuing until
+ * authentication succeeds or we exit due to signal.  If failures before a
+ * restart were recovered from the state file, continue the backoff from
+ * where it would have been.
+ */
+static krb5_error_code
+retry_auth(krb5_context ctx, struct config *config)
+{
+    krb5_error_code code;
+    struct timeval timeout;
+    unsigned int delay = 1;
+    unsigned long i;
+
+    for (i = 1; i < state.failures && delay < 30; i++)
+        delay *= 2;
+    code = locked_auth(ctx, config, 0);
+    while (code != 0) {
+        timeout.tv_sec = delay;
+        timeout.tv_usec = 0;
+        delay = (delay < 30) ? delay * 2 : delay;
+        select(0, NULL, NULL, NULL, &timeout);
+        if (exit_signaled)
+            exit_cleanup(ctx, config, 1);
+        code = locked_auth(ctx, config, 0);
+    }
+    return code;
+}
+
+
+/*
+ * Return the time at which the AFS token should next be refreshed, which is
+ * the -T margin before it expires, or 0 if -T wasn't given or we can't tell
+ * when the token expires because there is no token or we can't ask the AFS
+ * cache manager.
+ */
+static time_t
+token_due(struct config *config)
+{
+    time_t expires;
+
+    if (!config->do_aklog || config->token_margin == 0)
+        return 0;
+    if (k_tokenexpiry(&expires) < 0)
+        return 0;
+    return expires - config->token_margin * 60;
+}
+
+
+/*
+ * Get a new AFS token, either by running aklog or by giving it to the kernel
+ * AFS client ourselves.
+ */
+static void
+get_token(krb5_context ctx, struct config *config, const char *aklog)
+{
+    unsigned int timeout = config->aklog_timeout;
+    time_t now;
+    bool okay;
+
+    /*
+     * In a refresh with a time budget, aklog gets whatever time is left and
+     * the kernel AFS client may use it to talk to the KDC.
+     */
+    if (cycle_end != 0) {
+        now = time(NULL);
+        if (now >= cycle_end) {
+            warn("out of time for this refresh, not getting AFS token");
+            token_pending = true;
+            return;
+        }
+        if (timeout == 0 || (time_t) timeout > cycle_end - now)
+            timeout = cycle_end - now;
+        kdc_deadline(cycle_end);
+    }
+    if (afs_rxrpc)
+        okay = rxrpc_token(ctx, config, pags, &npags);
+    else {
+        aklog_status = command_run(aklog, timeout, &aklog_duration);
+        aklog_ran = true;
+        if (config->verbose && aklog_status >= 0)
+            notice("%s exited with status %d after %lu ms", aklog,
+                   aklog_status, aklog_duration);
+        okay = (aklog_status >= 0);
+    }
+    token_pending = (!okay && cycle_end != 0 && time(NULL) >= cycle_end);
+}
+
+
+/*
+ * Run aklog if we were told to with -t.  If -T was also given, skip it if the
+ * current AFS token doesn't expire within the margin, since aklog would only
+ * replace it with a token that lasts as long as our tickets do.
+ */
+static void
+run_aklog(krb5_context ctx, struct config *config, const char *aklog)
+{
+    time_t due;
+
+    if (!config->do_aklog)
+        return;
+    token_pending = false;
+    due = token_due(config);
+    if (due > time(NULL)) {
+        if (config->verbose)
+            notice("AFS token still good, not running aklog");
+        return;
+    }
+    get_token(ctx, config, aklog);
+}
+
+
+/*
+ * Write out a PID file given the path to the file, an open descriptor for it
+ * or -1, and the PID to write.  If given a descriptor, write through it and
+ * leave it open so that we keep our lock.  Errors are reported but otherwise
+ * ignored.
+ */
+static void
+write_pidfile(const char *path, int fd, pid_t pid)
+{
+    FILE *file;
+    char buffer[32];
+    size_t length;
+
+    if (fd >= 0) {
+        snprintf(buffer, sizeof(buffer), "%lu\n", (unsigned long) pid);
+        length = strlen(buffer);
+        if (ftruncate(fd, 0) < 0
+            || pwrite(fd, buffer, length, 0) != (ssize_t) length)
+            syswarn("cannot write to PID file %s", path);
+        return;
+    }
+    file = fopen(path, "w");
+    if (file == NULL) {
+        syswarn("cannot create PID file %s", path);
+        return;
+    }
+    if (fprintf(file, "%lu\n", (unsigned long) pid) < 0)
+        syswarn("cannot write to PID file %s", path);
+    if (fclose(file) == EOF)
+        syswarn("cannot flush PID file %s", path);
+}
+
+
+/*
+ * Try to take an exclusive lock on the open PID file without waiting.  The
+ * lock should belong to the open file rather than to the process so that the
+ * child keeps holding it when we background with daemon and the parent
+ * exits, so use flock where available and otherwise open file description
+ * locks.  If neither is available, the lock belongs to the process.  Returns
+ * 0 on success and -1 with errno set to EWOULDBLOCK if another process holds
+ * the lock.
+ */
+static int
+try_lock_pidfile(int fd)
+{
+#if defined(HAVE_FLOCK)
+    return flock(fd, LOCK_EX | LOCK_NB);
+#else
+    struct flock lock;
+    int status;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+# ifdef F_OFD_SETLK
+    status = fcntl(fd, F_OFD_SETLK, &lock);
+# else
+    status = fcntl(fd, F_SETLK, &lock);
+# endif
+    if (status < 0 && (errno == EACCES || errno == EAGAIN))
+        errno = EWOULDBLOCK;
+    return status;
+#endif
+}
+
+
+/*
+ * Return the PID written in the PID file by the process holding its lock,
+ * or 0 if there isn't one yet.
+ */
+static pid_t
+pidfile_owner(int fd)
+{
+    char buffer[32];
+    unsigned long pid;
+    ssize_t length;
+    char *end;
+
+    length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0)
+        return 0;
+    buffer[length] = '\0';
+    errno = 0;
+    pid = strtoul(buffer, &end, 10);
+    if (errno != 0 || end == buffer || *end != '\n')
+        return 0;
+    return (pid_t) pid;
+}
+
+
+/*
+ * Open the PID file, take an exclusive lock on it, and empty it, storing the
+ * descriptor in pidfile_fd.  Our PID is written to it later, once we know
+ * what it is after backgrounding.  We hold the lock until we exit.  If
+ * another process already holds the lock, what we do depends on the -E
+ * setting: by default, we just write our PID to the file anyway as always;
+ * with refuse, we exit with an error; and with replace, we send that process
+ * SIGTERM and wait for it to exit and release the lock.  The other process
+ * is found from the PID written in the file, which may not be there yet if
+ * it's still starting, so keep checking it.
+ *
+ * A process that exits removes the PID file while still holding the lock, so
+ * after getting the lock, make sure that the file we locked is still the one
+ * at that path and start over if it isn't.  A PID left in the file by a
+ * process that exited without removing it is removed so that nobody mistakes
+ * it for ours.
+ *
+ * This is called before the initial authentication so that we don't do any
+ * work if another process is already running, unless we're backgrounding and
+ * the lock wouldn't survive that, in which case it's called after.
+ */
+static void
+lock_pidfile(krb5_context ctx, struct config *config)
+{
+    const char *path = config->pidfile;
+    struct stat st, fst;
+    struct timeval wait;
+    pid_t owner;
+    pid_t signaled = 0;
+    int fd, status;
+
+    while (1) {
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            syswarn("cannot create PID file %s", path);
+            if (config->pidfile_action != PIDFILE_OVERWRITE)
+                exit_cleanup(ctx, config, 1);
+            return;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        status = try_lock_pidfile(fd);
+        if (status < 0 && errno == EWOULDBLOCK) {
+            if (config->pidfile_action == PIDFILE_OVERWRITE) {
+                close(fd);
+                return;
+            }
+            owner = pidfile_owner(fd);
+            if (config->pidfile_action == PIDFILE_REFUSE) {
+                if (owner > 0)
+                    warn("already running as PID %lu", (unsigned long) owner);
+                else
+                    warn("already running with PID file %s", path);
+                close(fd);
+                exit_cleanup(ctx, config, 1);
+            }
+            do {
+                if (owner > 0 && owner != signaled) {
+                    if (config->verbose)
+                        notice("replacing running process %lu",
+                               (unsigned long) owner);
+                    if (kill(owner, SIGTERM) < 0 && errno != ESRCH)
+                        syswarn("cannot signal process %lu",
+                                (unsigned long) owner);
+                    signaled = owner;
+                }
+                wait.tv_sec = 0;
+                wait.tv_usec = PIDFILE_POLL * 1000;
+                select(0, NULL, NULL, NULL, &wait);
+                status = try_lock_pidfile(fd);
+                owner = pidfile_owner(fd);
+            } while (status < 0 && (errno == EWOULDBLOCK || errno == EINTR));
+        }
+        if (status < 0) {
+            syswarn("cannot lock PID file %s", path);
+            close(fd);
+            if (config->pidfile_action != PIDFILE_OVERWRITE)
+                exit_cleanup(ctx, config, 1);
+            return;
+        }
+        if (fstat(fd, &fst) == 0 && stat(path, &st) == 0
+            && st.st_dev == fst.st_dev && st.st_ino == fst.st_ino)
+            break;
+        close(fd);
+    }
+    pidfile_fd = fd;
+    if (ftruncate(fd, 0) < 0)
+        syswarn("cannot truncate PID file %s", path);
+}
+
+
+/*
+ * Send the final line of a control reply for the given Kerberos status code:
+ * "ok" on success and otherwise "error" followed by the error code and the
+ * error message.
+ */
+static void
+control_result(krb5_context ctx, int client, krb5_error_code code)
+{
+    const char *message;
+
+    if (code == 0)
+        control_reply(client, "ok\n");
+    else {
+        message = krb5_get_error_message(ctx, code);
+        control_reply(client, "error %ld %s\n", (long) code, message);
+        krb5_free_error_message(ctx, message);
+    }
+}
+
+
+/*
+ * Answer a status request on the control socket.  Report the ticket cache,
+ * the principal and times of its ticket-granting ticket, when we last
+ * refreshed it, the number of consecutive failures, and the running command,
+ * and then whether we could read the ticket.
+ */
+static void
+control_status(krb5_context ctx, struct config *config, int client)
+{
+    krb5_creds *creds;
+    krb5_error_code code;
+    char *principal;
+    size_t i;
+
+    control_reply(client, "cache %s\n", config->cache);
+    code = find_tgt(ctx, config, &creds);
+    if (code == 0) {
+        code = krb5_unparse_name(ctx, creds->client, &principal);
+        if (code == 0) {
+            control_reply(client, "principal %s\n", principal);
+            krb5_free_unparsed_name(ctx, principal);
+        }
+        control_reply(client, "starts %lu\n",
+                      (unsigned long) creds->times.starttime);
+        control_reply(client, "expires %lu\n",
+                      (unsigned long) creds->times.endtime);
+        control_reply(client, "renew_until %lu\n",
+                      (unsigned long) creds->times.renew_till);
+        krb5_free_creds(ctx, creds);
+    }
+    control_reply(client, "refreshed %lu\n", (unsigned long) state.refreshed);
+    control_reply(client, "generation %lu\n",
+                  (unsigned long) generation->generation);
+    control_reply(client, "failures %lu\n", state.failures);
+    for (i = 0; i < config->ncommands; i++)
+        if (config->commands[i].pid > 0)
+            control_reply(client, "child %lu\n",
+                          (unsigned long) config->commands[i].pid);
+    for (i = 0; i < npags; i++)
+        control_reply(client, "pag %ld\n", pags[i]);
+    if (aklog_ran) {
+        control_reply(client, "aklog_status %d\n", aklog_status);
+        control_reply(client, "aklog_duration %lu\n", aklog_duration);
+    }
+    control_result(ctx, client, code);
+}
+
+
+/*
+ * Handle a register or unregister request on the control socket, which adds
+ * or removes the session keyring of another process to the ones that get our
+ * AFS tokens.  The argument is the serial number of the keyring.  A new
+ * keyring gets a token immediately, which also checks that we're able to
+ * write to it.  New session keyrings don't allow that, so the process has to
+ * grant us write permission first.
+ */
+static void
+control_register(krb5_context ctx, struct config *config, int client,
+                 const char *argument, bool add)
+{
+    long keyring;
+    size_t i, count;
+    char *end;
+
+    errno = 0;
+    keyring = strtol(argument, &end, 10);
+    if (errno != 0 || end == argument || *end != '\0' || keyring <= 0) {
+        control_reply(client, "error invalid keyring %s\n", argument);
+        return;
+    }
+    for (i = 0; i < npags; i++)
+        if (pags[i] == keyring)
+            break;
+    if (!add) {
+        if (i == npags) {
+            control_reply(client, "error keyring %ld not registered\n",
+                          keyring);
+            return;
+        }
+        memmove(pags + i, pags + i + 1, (npags - i - 1) * sizeof(long));
+        npags--;
+        control_reply(client, "ok\n");
+        return;
+    }
+    if (!config->do_aklog || !afs_rxrpc) {
+        control_reply(client, "error registering a PAG requires -t and"
+                      " the kernel AFS client\n");
+        return;
+    }
+    if (i < npags) {
+        control_reply(client, "ok\n");
+        return;
+    }
+    if (npags >= MAX_PAGS) {
+        control_reply(client, "error too many PAGs\n");
+        return;
+    }
+    count = 1;
+    if (!rxrpc_token(ctx, config, &keyring, &count) || count == 0) {
+        control_reply(client, "error cannot add token to keyring %ld (it"
+                      " must exist and grant us write permission)\n",
+                      keyring);
+        return;
+    }
+    pags = xreallocarray(pags, npags + 1, sizeof(long));
+    pags[npags++] = keyring;
+    control_reply(client, "ok\n");
+}
+
+
+/*
+ * Answer a request on the control socket other than renew, which is handled
+ * by the main loop since it has to wait for the result.  Returns true if the
+ * client connection has been kept open to watch for refreshes and false if
+ * the caller should close it.
  */
-static volatile sig_atomic_t exit_signaled = 0;
+static bool
+control_request(krb5_context ctx, struct config *config, const char *aklog,
+                int client, const char *request)
+{
+    if (config->verbose)
+        notice("control request: %s", request);
+    if (strcmp(request, "status") == 0)
+        control_status(ctx, config, client);
+    else if (strcmp(request, "error") == 0)
+        control_result(ctx, client, state.status);
+    else if (strcmp(request, "aklog") == 0) {
+        if (config->do_aklog) {
+            get_token(ctx, config, aklog);
+            control_reply(client, "ok\n");
+        } else
+            control_reply(client, "error not running aklog without -t\n");
+    } else if (strncmp(request, "register ", strlen("register ")) == 0)
+        control_register(ctx, config, client,
+                         request + strlen("register "), true);
+    else if (strncmp(request, "unregister ", strlen("unregister ")) == 0)
+        control_register(ctx, config, client,
+                         request + strlen("unregister "), false);
+    else if (strcmp(request, "upgrade") == 0) {
+        control_reply(client, "ok\n");
+        upgrade_signaled = 1;
+    } else if (strcmp(request, "watch") == 0) {
+        if (nwatchers >= MAX_WATCHERS) {
+            control_reply(client, "error too many watchers\n");
+            return false;
+        }
+        if (control_reply(client, "generation %lu\n",
+                          (unsigned long) generation->generation) < 0)
+            return false;
+        watchers = xreallocarray(watchers, nwatchers + 1, sizeof(int));
+        watchers[nwatchers++] = client;
+        return true;
+    } else
+        control_reply(client, "error unknown request %s\n", request);
+    return false;
+}
 
 
 /*
- * Convert from a string to a number, checking errors, and return -1 on any
- * error or for any negative number.  This doesn't really belong here, but
- * it's a tiny function used by both k5start and krenew.
+ * Report the state of the ticket cache to systemd as the service status:
+ * how long its ticket has left and whether the last refresh failed.
  */
-long
-convert_number(const char *string, int base)
+static void
+report_status(krb5_context ctx, struct config *config)
 {
-    long number;
-    char *end;
+    krb5_creds *creds;
+    krb5_error_code code;
+    const char *message;
+    time_t left;
 
-    errno = 0;
-    number = strtol(string, &end, base);
-    if (errno != 0 || *end != '\0')
-        return -1;
-    return number;
+    if (!systemd_enabled())
+        return;
+    code = find_tgt(ctx, config, &creds);
+    if (code != 0) {
+        message = krb5_get_error_message(ctx, code);
+        systemd_notify("STATUS=No valid ticket: %s", message);
+        krb5_free_error_message(ctx, message);
+        return;
+    }
+    left = creds->times.endtime - time(NULL);
+    if (left < 0)
+        left = 0;
+    krb5_free_creds(ctx, creds);
+    if (state.status != 0)
+        systemd_notify("STATUS=Refresh failed %lu times, ticket expires in"
+                       " %luh %02lum", state.failures,
+                       (unsigned long) left / 3600,
+                       (unsigned long) (left % 3600) / 60);
+    else
+        systemd_notify("STATUS=Ticket expires in %luh %02lum",
+                       (unsigned long) left / 3600,
+                       (unsigned long) (left % 3600) / 60);
 }
 
 
 /*
- * Signal handler for SIGALRM.  Just sets the global sentinel variable.
+ * Ping the systemd watchdog if it's due.  We only do so while the renewal
+ * loop is healthy: the last refresh succeeded or, if it failed, the ticket
+ * we have hasn't expired yet.  Otherwise, systemd will notice and can
+ * restart us.
  */
 static void
-alarm_handler(int s UNUSED)
+ping_watchdog(void)
 {
-    alarm_signaled = 1;
+    time_t now;
+
+    now = time(NULL);
+    if (watchdog_interval == 0 || now < watchdog_next)
+        return;
+    if (state.status == 0 || state.expires > now)
+        systemd_notify("WATCHDOG=1");
+    watchdog_next = now + watchdog_interval;
 }
 
 
 /*
- * Signal handler for SIGHUP and SIGTERM.  Just sets the global sentinel
- * variable.
+ * Wait for the given number of seconds or until we receive a signal.  If we
+ * have a control socket, answer requests on it while we wait, and drop any
+ * watchers that close their connections.  If the systemd watchdog is
+ * enabled, wake up to ping it when needed.  Returns the client descriptor if
+ * we received a renew request, which the caller should answer with
+ * control_result once the ticket cache has been refreshed and then close,
+ * and otherwise -1.
  */
-static void
-exit_handler(int s UNUSED)
+static int
+control_wait(krb5_context ctx, struct config *config, const char *aklog,
+             time_t seconds)
 {
-    exit_signaled = 1;
+    struct timeval timeout;
+    fd_set fds;
+    time_t end, now;
+    int client, maxfd, result;
+    size_t i;
+    char request[BUFSIZ];
+
+    end = time(NULL) + seconds;
+    do {
+        ping_watchdog();
+        now = time(NULL);
+        timeout.tv_sec = (end > now) ? end - now : 0;
+        timeout.tv_usec = 0;
+        if (watchdog_interval > 0 && watchdog_next - now < timeout.tv_sec)
+            timeout.tv_sec = watchdog_next - now;
+        FD_ZERO(&fds);
+        maxfd = -1;
+        if (control_fd >= 0) {
+            FD_SET(control_fd, &fds);
+            maxfd = control_fd;
+        }
+        for (i = 0; i < nwatchers; i++) {
+            FD_SET(watchers[i], &fds);
+            if (watchers[i] > maxfd)
+                maxfd = watchers[i];
+        }
+        result = select(maxfd + 1, &fds, NULL, NULL, &timeout);
+        if (result < 0)
+            return -1;
+        if (result == 0) {
+            if (time(NULL) >= end)
+                return -1;
+            continue;
+        }
+
+        /* Watchers only send anything by closing the connection. */
+        i = 0;
+        while (i < nwatchers) {
+            if (FD_ISSET(watchers[i], &fds)
+                && read(watchers[i], request, sizeof(request)) <= 0)
+                remove_watcher(i);
+            else
+                i++;
+        }
+        if (control_fd < 0 || !FD_ISSET(control_fd, &fds))
+            continue;
+        client = control_accept(control_fd, request, sizeof(request));
+        if (client < 0)
+            continue;
+        if (strcmp(request, "renew") == 0) {
+            if (config->verbose)
+                notice("control request: %s", request);
+            return client;
+        }
+        if (!control_request(ctx, config, aklog, client, request))
+            close(client);
+    } while (!exit_signaled && !upgrade_signaled && !alarm_signaled);
+    return -1;
 }
 
 
 /*
- * Get the principal name for the krbtgt ticket for the local realm.  The
- * caller is responsible for freeing the principal.  Takes an existing
- * principal to get the realm from and returns a Kerberos error on failure.
+ * Create the socket used to notify a command about refreshes with -N pipe
+ * and put the number of the command's end into the environment.  Our end is
+ * stored in the command struct and isn't inherited by the command.  Returns
+ * the command's end, which the caller should close once the command has been
+ * started.
  */
-static krb5_error_code
-get_krbtgt_princ(krb5_context ctx, krb5_principal user, krb5_principal *princ)
+static int
+notify_create(krb5_context ctx, struct config *config,
+              struct command *command)
 {
-    const char *realm;
+    int fds[2];
+    char *value;
 
-    realm = krb5_principal_get_realm(ctx, user);
-    if (realm == NULL)
-        return KRB5_CONFIG_NODEFREALM;
-    return krb5_build_principal(ctx, princ, strlen(realm), realm, "krbtgt",
-                                realm, (const char *) NULL);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        syswarn("cannot create notification socket");
+        exit_cleanup(ctx, config, 1);
+    }
+    command->notify_fd = fds[0];
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+
+        setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+    xasprintf(&value, "%d", fds[1]);
+    if (setenv(NOTIFY_ENV, value, 1) != 0) {
+        syswarn("cannot set %s environment variable", NOTIFY_ENV);
+        exit_cleanup(ctx, config, 1);
+    }
+    free(value);
+    return fds[1];
 }
 
 
 /*
- * Check whether a ticket will expire within the given number of minutes.
- * Takes the cache and the number of minutes.  Returns a Kerberos status code
- * which will be 0 if the ticket won't expire, KRB5KRB_AP_ERR_TKT_EXPIRED if
- * it will expire and can be renewed, or another error code for any other
- * situation.
- *
- * Don't report any errors here, since k5start doesn't want to warn about any
- * of these problems.  Just return the status code.  krenew will separately
- * report an error if appropriate.
+ * Tell the commands that their tickets have been refreshed, if -N was given,
+ * either by sending each running command a signal or by writing a newline to
+ * the socket it inherited.  If a socket is full, that command already has
+ * notifications it hasn't read, so don't send another.  If a command closed
+ * its end, stop notifying it.
  */
-static krb5_error_code
-ticket_expired(krb5_context ctx, struct config *config)
+static void
+notify_command(struct config *config)
 {
-    krb5_ccache ccache = NULL;
-    krb5_creds increds, *outcreds = NULL;
-    bool increds_valid = false;
-    time_t now, then, offset;
-    krb5_error_code code;
+    struct command *command;
+    ssize_t status;
+    size_t i;
 
-    /* Obtain the ticket. */
-    memset(&increds, 0, sizeof(increds));
-    code = krb5_cc_resolve(ctx, config->cache, &ccache);
-    if (code != 0)
-        goto done;
-    if (config->client != NULL)
-        increds.client = config->client;
-    else {
-        code = krb5_cc_get_principal(ctx, ccache, &increds.client);
-        if (code != 0)
-            goto done;
+    for (i = 0; i < config->ncommands; i++) {
+        command = &config->commands[i];
+        if (command->pid <= 0)
+            continue;
+        if (config->notify == NOTIFY_SIGNAL) {
+            if (kill(command->pid, config->notify_signal) < 0)
+                syswarn("cannot signal command %lu",
+                        (unsigned long) command->pid);
+            continue;
+        }
+        if (config->notify != NOTIFY_PIPE || command->notify_fd < 0)
+            continue;
+        do {
+            status = send(command->notify_fd, "\n", 1, MSG_NOSIGNAL);
+        } while (status < 0 && errno == EINTR);
+        if (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            if (errno != EPIPE && errno != ECONNRESET)
+                syswarn("cannot notify command %s", command->argv[0]);
+            else if (config->verbose)
+                notice("command %s closed its notification socket",
+                       command->argv[0]);
+            close(command->notify_fd);
+            command->notify_fd = -1;
+        }
     }
-    code = get_krbtgt_princ(ctx, increds.client, &increds.server);
-    if (code != 0)
-        goto done;
-    code = krb5_get_credentials(ctx, 0, ccache, &increds, &outcreds);
-    if (code != 0)
-        goto done;
-    increds_valid = true;
+}
 
-    /* Check the expiration time and renewal limit. */
-    if (code == 0) {
-        now = time(NULL);
-        then = outcreds->times.endtime;
-        if (config->happy_ticket > 0)
-            offset = 60 * (config->keep_ticket + config->happy_ticket);
-        else
-            offset = 60 * config->keep_ticket + EXPIRE_FUDGE;
-        if (then < now + offset)
-            code = KRB5KRB_AP_ERR_TKT_EXPIRED;
 
-        /*
-         * The error code for an inability to renew the ticket for long enough
-         * is arbitrary.  It just needs to be different than the error code
-         * that indicates we can renew the ticket and coordinated with the
-         * check in krenew's authentication callback.
-         *
-         * If the ticket is not going to expire, we skip this check.
-         * Otherwise, krenew -H 1 would fail even if the ticket had plenty of
-         * remaining lifespan if it was not renewable.
-         */
-        if (code == KRB5KRB_AP_ERR_TKT_EXPIRED) {
-            then = outcreds->times.renew_till;
-            if (then < now + offset)
-                code = KRB5KDC_ERR_KEY_EXP;
+/*
+ * If the path to a program is relative to the current directory, rather than
+ * a bare name to search for on the PATH or an absolute path, return it made
+ * absolute in newly allocated memory.  Otherwise, return NULL.  Used for
+ * programs we run after backgrounding, since that changes to the root
+ * directory.
+ */
+static char *
+absolute_path(const char *path)
+{
+    char *cwd, *result;
+    size_t size = 256;
+
+    if (path[0] == '/' || strchr(path, '/') == NULL)
+        return NULL;
+    cwd = xmalloc(size);
+    while (getcwd(cwd, size) == NULL) {
+        if (errno != ERANGE) {
+            syswarn("cannot get current directory");
+            free(cwd);
+            return NULL;
         }
+        size *= 2;
+        cwd = xrealloc(cwd, size);
     }
+    xasprintf(&result, "%s/%s", cwd, path);
+    free(cwd);
+    return result;
+}
 
-done:
-    if (increds.client == config->client)
-        increds.client = NULL;
-    if (ccache != NULL)
-        krb5_cc_close(ctx, ccache);
-    if (increds_valid)
-        krb5_free_cred_contents(ctx, &increds);
-    else {
-        if (increds.client != NULL)
-            krb5_free_principal(ctx, increds.client);
-        if (increds.server != NULL)
-            krb5_free_principal(ctx, increds.server);
+
+/*
+ * Start a command, setting up its -N pipe socket first if needed, and record
+ * its PID.  The -c PID file is for the first command.  Exits on failure.
+ */
+static void
+start_command(krb5_context ctx, struct config *config,
+              struct command *command)
+{
+    int command_fd = -1;
+
+    if (config->notify == NOTIFY_PIPE) {
+        if (command->notify_fd >= 0)
+            close(command->notify_fd);
+        command_fd = notify_create(ctx, config, command);
     }
-    if (outcreds != NULL)
-        krb5_free_creds(ctx, outcreds);
-    return code;
+    command->pid = command_start(command->path != NULL ? command->path
+                                                       : command->argv[0],
+                                 command->argv);
+    if (command->pid < 0) {
+        syswarn("unable to run command %s", command->argv[0]);
+        command->pid = 0;
+        exit_cleanup(ctx, config, 1);
+    }
+    command->started = time(NULL);
+    if (command_fd >= 0) {
+        close(command_fd);
+        unsetenv(NOTIFY_ENV);
+    }
+    if (config->childfile != NULL && command == &config->commands[0])
+        write_pidfile(config->childfile, -1, command->pid);
 }
 
 
 /*
- * Retry the initial authentication when the program is first starting.  Retry
- * the authentication immediately, then after one second, and keep trying with
- * exponential backoff, maxing out at one minute and continuing until
- * authentication succeeds or we exit due to signal.
+ * Called with -R when a command exits with the given wait status, with the
+ * last signal that was passed on to it or 0.  Decides whether to restart it
+ * and returns the number of seconds to wait before doing so, or -1 if it
+ * shouldn't be restarted.
+ *
+ * A command that exits successfully, or that exits after we passed on a
+ * signal telling it to stop, isn't restarted.  Otherwise, we restart it with
+ * exponential backoff up to the limit given with -R, starting over once the
+ * command has stayed up for RESTART_RESET seconds.
  */
-static krb5_error_code
-retry_auth(krb5_context ctx, struct config *config)
+static time_t
+restart_command(struct config *config, struct command *command, int status,
+                int sig)
 {
-    krb5_error_code code;
-    struct timeval timeout;
-    unsigned int delay = 1;
+    unsigned int delay;
 
-    code = config->auth(ctx, config, 0);
-    while (code != 0) {
-        timeout.tv_sec = delay;
-        timeout.tv_usec = 0;
-        delay = (delay < 30) ? delay * 2 : delay;
-        select(0, NULL, NULL, NULL, &timeout);
-        if (exit_signaled)
-            exit_cleanup(ctx, config, 1);
-        code = config->auth(ctx, config, 0);
+    if (config->restart == 0)
+        return -1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return -1;
+    if (command_stopped() != 0)
+        return -1;
+    if (WIFSIGNALED(status) && WTERMSIG(status) == sig)
+        return -1;
+    if (time(NULL) - command->started >= RESTART_RESET) {
+        command->restarts = 0;
+        command->delay = 1;
     }
-    return code;
+    if (command->restarts >= (unsigned long) config->restart) {
+        warn("command %s failed %lu times, giving up", command->argv[0],
+             command->restarts + 1);
+        return -1;
+    }
+    command->restarts++;
+    delay = command->delay;
+    if (command->delay < RESTART_MAX_DELAY)
+        command->delay = (command->delay * 2 < RESTART_MAX_DELAY)
+            ? command->delay * 2 : RESTART_MAX_DELAY;
+    if (WIFSIGNALED(status))
+        warn("command %s killed by signal %d, restarting in %u second%s",
+             command->argv[0], WTERMSIG(status), delay,
+             (delay == 1) ? "" : "s");
+    else
+        warn("command %s exited with status %d, restarting in %u second%s",
+             command->argv[0], WEXITSTATUS(status), delay,
+             (delay == 1) ? "" : "s");
+    return delay;
 }
 
 
 /*
- * Write out a PID file given the path to the file and the PID to write.
- * Errors are reported but otherwise ignored.
+ * Check on the commands: reap any that have exited, decide whether to restart
+ * them, and start any whose restart is due.  With -w any, once one command
+ * is done, the rest are sent SIGTERM and none are restarted.  Returns false
+ * once there are no more commands to wait for, with the exit status to use
+ * in status: that of the command that ended things with -w any, or the first
+ * failure with -w all.  Otherwise, returns true and sets timeout to the time
+ * until the next restart if that's sooner.
  */
-static void
-write_pidfile(const char *path, pid_t pid)
+static bool
+check_commands(krb5_context ctx, struct config *config, int *status,
+               time_t *timeout)
 {
-    FILE *file;
+    struct command *command;
+    time_t delay, now;
+    int result, sig, wait_status;
+    size_t i, remaining;
+    bool stopping = false;
+    bool was_stopping;
 
-    file = fopen(path, "w");
-    if (file == NULL) {
-        syswarn("cannot create PID file %s", path);
-        return;
+    for (i = 0; i < config->ncommands; i++)
+        if (config->commands[i].done && config->wait == WAIT_FOR_ANY)
+            stopping = true;
+    was_stopping = stopping;
+    for (i = 0; i < config->ncommands; i++) {
+        command = &config->commands[i];
+        if (command->pid <= 0)
+            continue;
+        result = command_finish(command->pid, &wait_status, &sig);
+        if (result < 0) {
+            syswarn("waitpid for %lu failed", (unsigned long) command->pid);
+            exit_cleanup(ctx, config, 1);
+        }
+        if (result == 0)
+            continue;
+        command->pid = 0;
+        delay = stopping ? -1 : restart_command(config, command, wait_status,
+                                                sig);
+        if (delay >= 0) {
+            command->restart_at = time(NULL) + delay;
+            continue;
+        }
+        command->done = true;
+        if (config->wait == WAIT_FOR_ANY) {
+            if (!stopping && WIFEXITED(wait_status))
+                *status = WEXITSTATUS(wait_status);
+            stopping = true;
+        } else if (*status == 0 && WIFEXITED(wait_status))
+            *status = WEXITSTATUS(wait_status);
     }
-    if (fprintf(file, "%lu\n", (unsigned long) pid) < 0)
-        syswarn("cannot write to PID file %s", path);
-    if (fclose(file) == EOF)
-        syswarn("cannot flush PID file %s", path);
+
+    /*
+     * Stop the remaining commands if we're stopping, and otherwise restart
+     * any whose time has come unless we were told to stop.
+     */
+    now = time(NULL);
+    remaining = 0;
+    for (i = 0; i < config->ncommands; i++) {
+        command = &config->commands[i];
+        if (command->done)
+            continue;
+        if (command->pid == 0 && (stopping || command_stopped() != 0)) {
+            command->done = true;
+            continue;
+        }
+        remaining++;
+        if (command->pid > 0) {
+            if (stopping && !was_stopping && kill(command->pid, SIGTERM) < 0)
+                syswarn("cannot stop command %lu",
+                        (unsigned long) command->pid);
+        } else if (now >= command->restart_at)
+            start_command(ctx, config, command);
+        else if (command->restart_at - now < *timeout)
+            *timeout = command->restart_at - now;
+    }
+
+    /*
+     * A command we just stopped may exit before we start waiting and we
+     * could miss its SIGCHLD, so check every second until they're all gone.
+     */
+    if (stopping && remaining > 0)
+        *timeout = 1;
+    return (remaining > 0);
 }
 
 
@@ -286,29 +2111,105 @@ add_handler(krb5_context ctx, struct config *config, void (*handler)(int),
 void
 run_framework(krb5_context ctx, struct config *config)
 {
-    const char *aklog;
+    const char *aklog, *path;
+    char *self;
     krb5_error_code code = 0;
-    pid_t child = 0;
-    int result;
+    struct command *command;
     int status = 0;
+    size_t i;
+    bool resumed = false;
+    bool upgraded, lock_late;
 
-    /* Set aklog from AKLOG, KINIT_PROG, or the compiled-in default. */
+    /*
+     * Take the systemd variables out of the environment before running
+     * anything, so that the commands and aklog don't notify systemd.
+     */
+    systemd_init();
+
+    /*
+     * Set aklog from AKLOG, KINIT_PROG, or the compiled-in default.  If
+     * neither variable is set and this system uses the Linux kernel AFS
+     * client rather than OpenAFS, we give it tokens ourselves instead.
+     */
+    kdc_init(ctx, config);
     aklog = getenv("AKLOG");
     if (aklog == NULL)
         aklog = getenv("KINIT_PROG");
+    if (aklog == NULL && config->do_aklog && !k_hasafs())
+        afs_rxrpc = rxrpc_available();
     if (aklog == NULL)
         aklog = PATH_AKLOG;
-    if (aklog[0] == '\0' && config->do_aklog) {
+    if (aklog[0] == '\0' && config->do_aklog && !afs_rxrpc) {
         warn("set AKLOG to specify the path to aklog");
         exit_cleanup(ctx, config, 1);
     }
 
+    /*
+     * If we were started by re-executing a previous binary, pick up its state
+     * and skip everything that it already did: creating a PAG, the initial
+     * authentication, backgrounding, and starting the command.
+     */
+    upgraded = upgrade_state(config, &state.refreshed, NULL);
+    if (upgraded) {
+        unsetenv(UPGRADE_ENV);
+        for (i = 0; i < config->ncommands; i++)
+            if (config->commands[i].notify_fd >= 0)
+                fcntl(config->commands[i].notify_fd, F_SETFD, FD_CLOEXEC);
+        if (config->verbose)
+            notice("resuming after re-exec");
+    }
+
+    /*
+     * If renewals should be serialized with other processes, find the lock
+     * file, which is the path to the ticket cache with .lock appended.
+     */
+    if (config->lock_cache) {
+        path = cache_path(config->cache);
+        if (path == NULL) {
+            warn("-W requires a file ticket cache");
+            exit_cleanup(ctx, config, 1);
+        }
+        xasprintf(&config->lockfile, "%s.lock", path);
+    }
+
+    /*
+     * Lock the PID file before doing anything else so that, if another
+     * process already holds it, we can refuse to run or take over from it
+     * before authenticating.  If the lock belongs to the process and we're
+     * going to background, wait and take it in the child instead, since
+     * there would otherwise be a window after backgrounding when nobody
+     * holds it.
+     */
+    lock_late = (!PIDFILE_LOCK_INHERITED && config->background && !upgraded);
+    if (config->pidfile != NULL && !lock_late)
+        lock_pidfile(ctx, config);
+
+    /* Map the generation file, if any, so that refreshes are recorded. */
+    if (config->genfile != NULL) {
+        generation = generation_open(config->genfile);
+        if (generation == NULL)
+            exit_cleanup(ctx, config, 1);
+    }
+
     /*
      * If built with setpag support and we're running a command, create the
-     * new PAG now before the first authentication.
+     * new PAG now before the first authentication.  For the kernel AFS
+     * client, that's a new session keyring, which a private keyring ticket
+     * cache has already created.  OpenAFS on Linux also replaces the session
+     * keyring when creating a PAG, which would lose a private keyring ticket
+     * cache, so refuse to combine the two.
      */
-    if (config->command != NULL && config->do_aklog) {
-        if (k_hasafs()) {
+    if (config->command != NULL && config->do_aklog && !upgraded) {
+        if (afs_rxrpc) {
+            if (config->private_cache != PRIVATE_KEYRING
+                && rxrpc_setpag() < 0) {
+                syswarn("unable to create session keyring");
+                exit_cleanup(ctx, config, 1);
+            }
+        } else if (config->private_cache == PRIVATE_KEYRING) {
+            warn("-M keyring with -t requires the kernel AFS client");
+            exit_cleanup(ctx, config, 1);
+        } else if (k_capabilities() & KAFS_CAP_SETPAG) {
             if (k_setpag() < 0) {
                 syswarn("unable to create PAG");
                 exit_cleanup(ctx, config, 1);
@@ -322,15 +2223,22 @@ run_framework(krb5_context ctx, struct config *config)
     /* 
      * Do the authentication once even if not necessary so that we can check
      * for any problems while we still have standard error.  If -H wasn't set,
-     * always authenticate.  If -H was set, authenticate only if the ticket
-     * isn't expired.
+     * always authenticate unless the state file says that the existing
+     * ticket cache is the one we were maintaining and it's still good.  If
+     * -H was set, authenticate only if the ticket isn't expired.
      */
-    if (config->happy_ticket == 0)
-        code = config->auth(ctx, config, 0);
-    else {
+    if (upgraded)
+        resumed = true;
+    else if (config->happy_ticket == 0) {
+        resumed = resume_state(ctx, config);
+        if (!resumed)
+            code = locked_auth(ctx, config, 0);
+        else if (config->resume != NULL)
+            config->resume(ctx, config);
+    } else {
         code = ticket_expired(ctx, config);
         if (code != 0)
-            code = config->auth(ctx, config, code);
+            code = locked_auth(ctx, config, code);
     }
     if (code != 0)
         status = 1;
@@ -338,24 +2246,43 @@ run_framework(krb5_context ctx, struct config *config)
         exit_cleanup(ctx, config, status);
 
     /* If requested, run the aklog program. */
-    if (code == 0 && config->do_aklog)
-        command_run(aklog, config->verbose);
+    if (code == 0 && !upgraded)
+        run_aklog(ctx, config, aklog);
 
     /*
      * If told to background, background ourselves.  We do this late so that
      * we can report initial errors.  We have to do this before spawning the
      * command, though, since we want to background the command as well and
      * since otherwise we wouldn't be able to wait for the child process.
+     * Backgrounding changes to the root directory, so first make the paths
+     * of the commands and our own path for re-executing absolute if they're
+     * relative to the current directory.
      */
-    if (config->background)
+    if (config->background && !upgraded) {
+        for (i = 0; i < config->ncommands; i++) {
+            command = &config->commands[i];
+            command->path = absolute_path(command->argv[0]);
+        }
+        if (config->argv != NULL) {
+            self = absolute_path(config->argv[0]);
+            if (self != NULL)
+                config->argv[0] = self;
+        }
         if (daemon(0, 0) < 0) {
             syswarn("cannot background");
             exit_cleanup(ctx, config, 1);
         }
+    }
 
-    /* Write out the PID file. */
-    if (config->pidfile != NULL)
-        write_pidfile(config->pidfile, getpid());
+    /*
+     * Write our PID, which changed if we backgrounded, to the PID file,
+     * taking the lock on it first if we waited to do that until now.
+     */
+    if (config->pidfile != NULL) {
+        if (lock_late)
+            lock_pidfile(ctx, config);
+        write_pidfile(config->pidfile, pidfile_fd, getpid());
+    }
 
     /*
      * Now, if the initial authentication failed and we're ignoring initial
@@ -373,59 +2300,161 @@ run_framework(krb5_context ctx, struct config *config)
         add_handler(ctx, config, exit_handler, SIGHUP, "SIGHUP");
         add_handler(ctx, config, exit_handler, SIGTERM, "SIGTERM");
         code = retry_auth(ctx, config);
-        if (code == 0 && config->do_aklog)
-            command_run(aklog, config->verbose);
+        if (code == 0)
+            run_aklog(ctx, config, aklog);
     }
 
-    /* Spawn the external command, if we were told to run one. */
-    if (config->command != NULL) {
-        child = command_start(config->command[0], config->command);
-        if (child < 0) {
-            syswarn("unable to run command %s", config->command[0]);
+    /*
+     * Spawn the external commands, if we were told to run any, or take over
+     * the ones that are already running if we were re-executed.  Commands
+     * that the previous binary was waiting to restart are started now.
+     */
+    for (i = 0; i < config->ncommands; i++) {
+        command = &config->commands[i];
+        if (command->done)
+            continue;
+        if (command->pid == 0) {
+            start_command(ctx, config, command);
+            continue;
+        }
+        if (command_adopt(command->pid) < 0) {
+            syswarn("unable to take over command %s", command->argv[0]);
             exit_cleanup(ctx, config, 1);
         }
+        command->started = time(NULL);
+        if (config->childfile != NULL && i == 0)
+            write_pidfile(config->childfile, -1, command->pid);
+    }
+    if (config->command != NULL) {
+        status = 0;
         if (config->keep_ticket == 0)
             config->keep_ticket = 60;
-        if (config->childfile != NULL)
-            write_pidfile(config->childfile, child);
-        config->child = child;
+    }
+
+    /*
+     * If run by systemd, tell it that we're ready now that we have tickets,
+     * giving it our PID in case we backgrounded, and start pinging the
+     * watchdog if it's enabled.
+     */
+    if (systemd_enabled()) {
+        systemd_notify("READY=1\nMAINPID=%lu", (unsigned long) getpid());
+        report_status(ctx, config);
+        watchdog_interval = systemd_watchdog();
+        ping_watchdog();
     }
 
     /* Loop if we're running as a daemon. */
     if (config->keep_ticket > 0) {
-        struct timeval timeout;
+        time_t timeout;
+        int client;
 
+        /*
+         * Create the control socket now that we're ready to answer requests
+         * on it.
+         */
+        if (config->control != NULL) {
+            control_fd = control_open(config->control);
+            if (control_fd < 0)
+                exit_cleanup(ctx, config, 1);
+        }
         add_handler(ctx, config, alarm_handler, SIGALRM, "SIGALRM");
+        add_handler(ctx, config, upgrade_handler, SIGUSR2, "SIGUSR2");
         if (config->command == NULL) {
             add_handler(ctx, config, exit_handler, SIGHUP, "SIGHUP");
             add_handler(ctx, config, exit_handler, SIGTERM, "SIGTERM");
         }
         while (1) {
-            if (config->command != NULL) {
-                result = command_finish(child, &status);
-                if (result < 0) {
-                    syswarn("waitpid for %lu failed", (unsigned long) child);
-                    exit_cleanup(ctx, config, 1);
-                }
-                if (result > 0) {
-                    config->child = 0;
+            if (code == 0 && !token_pending)
+                timeout = config->keep_ticket * 60;
+            else
+                timeout = 60;
+
+            /*
+             * Check on the commands, restarting them in the same PAG with
+             * the same ticket cache if they failed and -R was given, and
+             * stop once there are no more to wait for.
+             */
+            if (config->command != NULL)
+                if (!check_commands(ctx, config, &status, &timeout))
                     break;
+
+            /*
+             * If we resumed from the state file or a re-exec, wake up the
+             * first time when the next check would have been due before the
+             * restart.
+             */
+            if (resumed) {
+                time_t next, now;
+
+                next = state.refreshed + config->keep_ticket * 60;
+                now = time(NULL);
+                if (next < now)
+                    timeout = 0;
+                else if (next - now < timeout)
+                    timeout = next - now;
+                resumed = false;
+            }
+
+            /*
+             * With -T, refreshing the tickets only runs aklog if the token
+             * is close to expiring, so also wake up when the token is due to
+             * be refreshed.  Don't wake up more than once a minute in case
+             * aklog isn't able to get a new token.
+             */
+            if (code == 0 && config->token_margin > 0) {
+                time_t due, now;
+
+                due = token_due(config);
+                now = time(NULL);
+                if (due > 0) {
+                    due = (due > now) ? due - now : 0;
+                    if (due < 60)
+                        due = 60;
+                    if (due < timeout)
+                        timeout = due;
                 }
             }
-            timeout.tv_sec = (code == 0) ? config->keep_ticket * 60 : 60;
-            timeout.tv_usec = 0;
-            select(0, NULL, NULL, NULL, &timeout);
-            if (exit_signaled)
+            client = control_wait(ctx, config, aklog, timeout);
+            if (exit_signaled) {
+                if (client >= 0)
+                    close(client);
                 exit_cleanup(ctx, config, 0);
+            }
+            if (upgrade_signaled) {
+                upgrade_signaled = 0;
+                upgrade(config);
+            }
+
+            /*
+             * A renew request on the control socket forces a refresh like
+             * SIGALRM, and the client waits for the result.  The refresh
+             * has a time budget, and if it runs out, it's tried again at the
+             * next wakeup a minute later.  A token that we didn't have time
+             * to get is tried again the same way.
+             */
             code = ticket_expired(ctx, config);
-            if (alarm_signaled || config->always_renew || code != 0) {
-                code = config->auth(ctx, config, code);
+            if (alarm_signaled || client >= 0 || config->always_renew
+                || code != 0) {
+                cycle_start(ctx, config);
+                code = locked_auth(ctx, config, code);
+                if (code == 0) {
+                    run_aklog(ctx, config, aklog);
+                    notify_command(config);
+                }
+                cycle_finish();
+                if (client >= 0) {
+                    control_result(ctx, client, code);
+                    close(client);
+                }
                 if (code != 0 && config->exit_errors)
                     exit_cleanup(ctx, config, 1);
-                if (code == 0 && config->do_aklog)
-                    command_run(aklog, config->verbose);
+            } else if (config->token_margin > 0 || token_pending) {
+                cycle_start(ctx, config);
+                run_aklog(ctx, config, aklog);
+                cycle_finish();
             }
             alarm_signaled = 0;
+            report_status(ctx, config);
         }
     }
 
@@ -445,6 +2474,7 @@ exit_cleanup(krb5_context ctx, struct config *config, int status)
     krb5_error_code code;
     krb5_ccache ccache;
 
+    systemd_notify("STOPPING=1");
     if (config->cleanup != NULL)
         config->cleanup(ctx, config, status);
     if (config->clean_cache) {
@@ -455,9 +2485,13 @@ exit_cleanup(krb5_context ctx, struct config *config, int status)
             warn_krb5(ctx, code, "cannot destroy ticket cache");
     }
     if (config->pidfile != NULL)
-        unlink(config->pidfile);
-    if (config->childfile != NULL)
+        if (pidfile_fd >= 0 || config->pidfile_action == PIDFILE_OVERWRITE)
+            unlink(config->pidfile);
+    if (config->childfile != NULL && config->command != NULL
+        && config->commands[0].started != 0)
         unlink(config->childfile);
+    if (control_fd >= 0)
+        unlink(config->control);
     krb5_free_context(ctx);
     exit(status);
 }
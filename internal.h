@@ -21,10 +21,89 @@
 #include <portable/macros.h>
 #include <portable/stdbool.h>
 
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+
 /* Private structs used by krenew and k5start for internal configuration. */
 struct k5start_private;
 struct krenew_private;
 
+/* How hard to try to get ticket cache writes onto disk. */
+enum sync_policy {
+    SYNC_NONE = 0,              /* Leave it to the Kerberos libraries. */
+    SYNC_DATA,                  /* Flush the data of the cache file. */
+    SYNC_FULL                   /* Also flush the containing directory. */
+};
+
+/* Where to create the private ticket cache when running a command. */
+enum private_cache {
+    PRIVATE_FILE = 0,           /* A file in /tmp. */
+    PRIVATE_TMPFS,              /* A file on a memory-backed file system. */
+    PRIVATE_KEYRING             /* A new Linux session keyring. */
+};
+
+/* What to do if another process is holding the PID file. */
+enum pidfile_action {
+    PIDFILE_OVERWRITE = 0,      /* Write our PID to it anyway. */
+    PIDFILE_REFUSE,             /* Exit with an error. */
+    PIDFILE_REPLACE             /* Terminate that process and take over. */
+};
+
+/* How to tell the command that its tickets were refreshed, from -N. */
+enum notify_method {
+    NOTIFY_NONE = 0,            /* Don't tell it. */
+    NOTIFY_SIGNAL,              /* Send it a signal. */
+    NOTIFY_PIPE                 /* Write a byte to a socket it inherited. */
+};
+
+/* When to stop when running several commands, from -w. */
+enum wait_policy {
+    WAIT_FOR_ANY = 0,           /* Stop all commands when any one exits. */
+    WAIT_FOR_ALL                /* Keep running until all commands exit. */
+};
+
+/*
+ * A command to run and maintain tickets for.  The positional command and
+ * each command given with -A get one of these.
+ */
+struct command {
+    char **argv;                /* NULL-terminated command and arguments. */
+    char *path;                 /* Absolute path to run, if not argv[0]. */
+    pid_t pid;                  /* PID while running, otherwise 0. */
+    bool done;                  /* Exited and won't be restarted. */
+    int notify_fd;              /* Our end of the -N pipe socket, or -1. */
+    time_t started;             /* When the command was last started. */
+    time_t restart_at;          /* When to restart it if it isn't running. */
+    unsigned long restarts;     /* Restarts since it last stayed up. */
+    unsigned int delay;         /* Delay before the next restart. */
+};
+
+/* Scheduler state saved across restarts in the state file given with -j. */
+struct state {
+    char *cache;                /* Ticket cache the state is for. */
+    char *principal;            /* Principal of the tickets in that cache. */
+    time_t refreshed;           /* When the cache was last refreshed. */
+    time_t expires;             /* When the tickets in the cache expire. */
+    unsigned long failures;     /* Consecutive failed refresh attempts. */
+    krb5_error_code status;     /* Result of the last refresh attempt. */
+};
+
+/*
+ * The contents of the generation file given with -G, which is mapped into
+ * memory so that other processes can cheaply check for refreshed tickets.
+ * Each field is an unsigned 64-bit integer in native byte order.  The
+ * generation is stored after the times with release semantics, so a reader
+ * that loads it with acquire semantics (__atomic_load_n with
+ * __ATOMIC_ACQUIRE, for instance) and then reads the times sees those of
+ * that refresh or a later one.
+ */
+struct generation {
+    uint64_t generation;        /* Incremented on each refresh. */
+    uint64_t refreshed;         /* When the ticket cache was refreshed. */
+    uint64_t expires;           /* When the tickets in the cache expire. */
+};
+
 /* The struct used to pass configuration details to run_framework. */
 struct config {
     bool always_renew;          /* Whether to renew on every wakeup. */
@@ -33,18 +112,37 @@ struct config {
     bool do_aklog;              /* Whether to run aklog. */
     bool exit_errors;           /* Whether to exit on error as a daemon. */
     bool ignore_errors;         /* Ignore errors on initial authentication. */
+    bool lock_cache;            /* Serialize renewals with a lock file. */
     bool verbose;               /* Whether to do verbose logging. */
 
+    char **argv;                /* Our own arguments, used to re-exec. */
     char **command;             /* NULL-terminated command to run, if any. */
+    struct command *commands;   /* All commands to run, starting with that. */
+    size_t ncommands;           /* Count of commands to run. */
+    enum wait_policy wait;      /* When to stop with several commands. */
     int happy_ticket;           /* Remaining life of ticket required. */
     int keep_ticket;            /* How often to wake up to check ticket. */
+    int restart;                /* How many times to restart the command. */
+    int token_margin;           /* Run aklog when token is this near expiry. */
+    int aklog_timeout;          /* Kill aklog after this many seconds. */
+    int hedge;                  /* Percentile after which to try next KDC. */
+    enum sync_policy sync;      /* Durability of ticket cache writes. */
+    enum private_cache private_cache; /* Type of private cache for command. */
 
     const char *aklog;          /* Path to aklog. */
 
     const char *childfile;      /* Path to child PID file to write out. */
+    const char *control;        /* Path to the control socket, if any. */
     const char *pidfile;        /* Path to PID file to write out. */
+    enum pidfile_action pidfile_action; /* If the PID file is already held. */
+
+    enum notify_method notify;  /* How to tell the command about refreshes. */
+    int notify_signal;          /* Signal to send with NOTIFY_SIGNAL. */
 
     const char *cache;          /* Ticket cache to maintain. */
+    char *lockfile;             /* Lock file for the ticket cache, if any. */
+    const char *statefile;      /* Path to the scheduler state file. */
+    const char *genfile;        /* Path to the generation file. */
 
     /*
      * Desired principal.  If set, checks ticket cache for that principal in
@@ -53,12 +151,6 @@ struct config {
      */
     krb5_principal client;
 
-    /*
-     * The PID of the running child.  This is stored in the config struct so
-     * that the calling program can access it during the cleanup callback.
-     */
-    pid_t child;
-
     /* Private data for the two programs. */
     union {
         struct k5start_private *k5start;
@@ -68,6 +160,7 @@ struct config {
     /* Callbacks. */
     krb5_error_code (*auth)(krb5_context, struct config *, krb5_error_code);
     void (*cleanup)(krb5_context, struct config *, krb5_error_code);
+    void (*resume)(krb5_context, struct config *);
 };
 
 BEGIN_DECLS
@@ -88,9 +181,156 @@ void run_framework(krb5_context, struct config *)
 void exit_cleanup(krb5_context, struct config *, int status)
     __attribute__((__nonnull__, __noreturn__));
 
-/* A small helper routine for parsing command-line options. */
+/* Small helper routines for parsing command-line options. */
 long convert_number(const char *string, int base)
     __attribute__((__nonnull__));
+bool convert_sync_policy(const char *string, enum sync_policy *)
+    __attribute__((__nonnull__));
+bool convert_private_cache(const char *string, enum private_cache *)
+    __attribute__((__nonnull__));
+bool convert_pidfile_action(const char *string, enum pidfile_action *)
+    __attribute__((__nonnull__));
+bool convert_notify(const char *string, enum notify_method *, int *signal)
+    __attribute__((__nonnull__));
+bool convert_wait_policy(const char *string, enum wait_policy *)
+    __attribute__((__nonnull__));
+
+/*
+ * Add a command to run.  add_command takes a NULL-terminated argument vector
+ * and adds it before any other commands if first is true.  add_shell_command
+ * adds a command line given with -A, which is run with /bin/sh -c.  Either
+ * way, config->command is set to the first command.
+ */
+void add_command(struct config *, char **argv, bool first)
+    __attribute__((__nonnull__));
+void add_shell_command(struct config *, const char *command)
+    __attribute__((__nonnull__));
+
+/*
+ * Create a new, empty private ticket cache for a command of the given type
+ * and return its name in newly allocated memory.  Dies on failure.
+ */
+char *private_cache_create(enum private_cache);
+
+/*
+ * If the program was started by re-executing itself on SIGUSR2, returns the
+ * ticket cache that the previous binary was maintaining in newly allocated
+ * memory.  Otherwise, returns NULL.
+ */
+char *upgrade_cache(void);
+
+/*
+ * Returns the path to the file underlying a ticket cache name if it is a file
+ * cache (with or without a FILE: or WRFILE: prefix), or NULL for any other
+ * cache type.
+ */
+const char *cache_path(const char *cache)
+    __attribute__((__nonnull__));
+
+/*
+ * Flush a ticket cache file and, with SYNC_FULL, the directory containing it,
+ * according to the configured sync policy.  Both only report errors, since
+ * the credentials have already been written by then, and do nothing for
+ * caches that aren't files.
+ */
+void sync_cache_file(struct config *, const char *cache)
+    __attribute__((__nonnull__));
+void sync_cache_dir(struct config *, const char *cache)
+    __attribute__((__nonnull__));
+
+/*
+ * If verbose, report how long a ticket cache write took, given the time at
+ * which it was started.
+ */
+void report_cache_write(struct config *, const struct timeval *start)
+    __attribute__((__nonnull__));
+
+/*
+ * The control socket.  control_open creates the socket and returns its file
+ * descriptor, or -1 after reporting an error.  control_accept accepts a
+ * connection from an authorized peer and reads its request without the
+ * trailing newline, returning the client file descriptor or -1 if there was
+ * no valid request.  control_reply sends part of the reply to a client and
+ * returns -1 if the client has gone away.
+ */
+int control_open(const char *path)
+    __attribute__((__nonnull__));
+int control_accept(int fd, char *request, size_t size)
+    __attribute__((__nonnull__));
+int control_reply(int client, const char *format, ...)
+    __attribute__((__nonnull__, __format__(printf, 2, 3)));
+
+/*
+ * Notify systemd about our status when run as a Type=notify service.
+ * systemd_init saves the systemd environment variables and removes them from
+ * the environment so that other programs don't inherit them, and
+ * systemd_export puts them back before re-executing ourselves, returning
+ * false on failure.  systemd_enabled returns true if systemd gave us a
+ * notification socket.  systemd_notify sends a notification, formatted as
+ * with printf, and does nothing if not run by systemd.  systemd_watchdog
+ * returns how often to ping the watchdog in seconds, or 0 if the watchdog
+ * isn't enabled for us.
+ */
+void systemd_init(void);
+bool systemd_export(void);
+bool systemd_enabled(void);
+void systemd_notify(const char *format, ...)
+    __attribute__((__nonnull__, __format__(printf, 1, 2)));
+time_t systemd_watchdog(void);
+
+/*
+ * Read, write, and free the scheduler state.  state_read returns false if the
+ * state file doesn't exist or isn't valid.  state_write reports errors but
+ * otherwise ignores them.
+ */
+bool state_read(const char *path, struct state *)
+    __attribute__((__nonnull__));
+void state_write(const char *path, const struct state *)
+    __attribute__((__nonnull__));
+void state_free(struct state *)
+    __attribute__((__nonnull__));
+
+/*
+ * Open the generation file, creating it if necessary, and map it into
+ * memory.  Returns NULL after reporting an error on failure.
+ */
+struct generation *generation_open(const char *path)
+    __attribute__((__nonnull__));
+
+/*
+ * Give AFS tokens directly to the Linux kernel AFS client.  rxrpc_available
+ * returns true if that client is loaded.  rxrpc_setpag joins a new session
+ * keyring, which serves as its PAG, and returns -1 with errno set on
+ * failure.  rxrpc_token adds a token for the local cell made from the
+ * tickets in the ticket cache to our session keyring and to each of the
+ * given keyrings, removing keyrings that no longer exist or that we can't
+ * write to from the array.  It reports errors and returns false if our own
+ * token couldn't be added.
+ */
+bool rxrpc_available(void);
+int rxrpc_setpag(void);
+bool rxrpc_token(krb5_context, struct config *, long *keyrings,
+                 size_t *nkeyrings)
+    __attribute__((__nonnull__(1, 2, 4)));
+
+/*
+ * Hooks into communication with the KDC.  kdc_init installs them in the
+ * Kerberos context, including sending requests to several KDCs with -e.
+ * kdc_deadline sets the time after which requests to the KDC fail instead of
+ * being sent, or removes the limit if given 0.  Requests already sent are
+ * only cut off at that time with -e.  Both do nothing if the Kerberos
+ * libraries don't support these hooks.
+ */
+void kdc_init(krb5_context, struct config *)
+    __attribute__((__nonnull__));
+void kdc_deadline(time_t);
+
+/*
+ * Write the health of each KDC used with -e to the state file as kdc lines.
+ * The framework reads them back when it installs the hooks.
+ */
+void kdc_stats_write(FILE *)
+    __attribute__((__nonnull__));
 
 END_DECLS
 
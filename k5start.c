@@ -22,9 +22,11 @@
 #include <portable/krb5.h>
 #include <portable/system.h>
 
-#include <ctype.h>
 #include <errno.h>
 #include <grp.h>
+#ifdef HAVE_PROFILE_H
+# include <profile.h>
+#endif
 #include <pwd.h>
 #include <sys/stat.h>
 #include <syslog.h>
@@ -39,6 +41,19 @@
 /* The default ticket lifetime in minutes.  Default to 10 hours. */
 #define DEFAULT_LIFETIME (10 * 60)
 
+/*
+ * A ticket cache into which to store the credentials that we obtain, along
+ * with the ownership and permissions to give it.  The first destination is
+ * always the main ticket cache; any others come from -O.
+ */
+struct k5start_dest {
+    const char *cache;          /* Ticket cache (a path if set_perms). */
+    uid_t owner;                /* Owner of created ticket cache. */
+    gid_t group;                /* Group of created ticket cache. */
+    mode_t mode;                /* Mode of created ticket cache. */
+    bool set_perms;             /* Whether to set owner and perms on cache. */
+};
+
 /*
  * Holds the various command-line options for passing to functions, after
  * processing in the main routine and conversion to internal Kerberos data
@@ -50,11 +65,10 @@ struct k5start_private {
     const char *keytab;         /* Keytab to use to authenticate. */
     bool quiet;                 /* Whether to silence even normal output. */
     bool stdin_passwd;          /* Whether to get the password from stdin. */
-    uid_t owner;                /* Owner of created ticket cache. */
-    uid_t group;                /* Group of created ticket cache. */
-    mode_t mode;                /* Mode of created ticket cache. */
-    bool set_perms;             /* Whether to set owner and perms on cache. */
-    const char *cache;          /* Path to destination cache. */
+    struct k5start_dest *dests; /* Destination ticket caches. */
+    size_t ndests;              /* Count of destination ticket caches. */
+    const char **realms;        /* Realms to get cross-realm tickets for. */
+    size_t nrealms;             /* Count of those realms. */
     krb5_get_init_creds_opt *kopts;
 };
 
@@ -67,32 +81,62 @@ Usage: k5start [options] [name [command]]\n\
    -I <service instance>        (default: realm name)\n\
    -r <service realm>           (default: local realm)\n\
 \n\
+   -A <command>         Also run <command> with /bin/sh -c (may be repeated)\n\
    -a                   Renew on each wakeup when running as a daemon\n\
    -b                   Fork and run in the background\n\
+   -C <path>            Accept requests on a control socket at <path>\n\
    -c <file>            Write child process ID (PID) to <file>\n\
+   -D <policy>          Flush ticket cache writes to disk: none (default),\n\
+                        data, or full (data and directory)\n\
+   -d <seconds>         Kill aklog and everything it started if it runs for\n\
+                        longer than <seconds>\n\
+   -E <action>          If another process holds the PID file from -p,\n\
+                        refuse to run or replace that process\n\
+   -e <percentile>      Also send KDC requests to the next KDC if no reply\n\
+                        arrives within this percentile of recent replies\n\
    -F                   Force non-forwardable tickets\n\
    -f <keytab>          Use <keytab> for authentication rather than password\n\
+   -G <file>            Increment a generation counter in <file> on each\n\
+                        ticket cache refresh\n\
    -g <group>           Set ticket cache group to <group>\n\
    -H <limit>           Check for a happy ticket, one that doesn't expire in\n\
                         less than <limit> minutes, and exit 0 if it's okay,\n\
                         otherwise obtain a ticket\n\
    -h                   Display this usage message and exit\n\
+   -j <file>            Save scheduler state in <file> and, on startup, don't\n\
+                        authenticate if the ticket cache is still good\n\
    -K <interval>        Run as daemon, check ticket every <interval> minutes\n\
                         (implies -q unless -v is given)\n\
    -k <file>            Use <file> as the ticket cache\n\
    -L                   Log messages via syslog as well as stderr\n\
    -l <lifetime>        Ticket lifetime in minutes\n\
+   -M <type>            Type of private ticket cache for a command: file\n\
+                        (default), tmpfs, or keyring\n\
    -m <mode>            Set ticket cache permissions to <mode> (octal)\n\
+   -N <method>          Notify a command after each refresh with a signal\n\
+                        (by name or number) or by writing to a pipe\n\
+   -O <destination>     Also store tickets in another ticket cache, given\n\
+                        as [owner]:[group]:[mode]:<cache> (may be repeated)\n\
    -o <owner>           Set ticket cache owner to <owner>\n\
    -P                   Force non-proxiable tickets\n\
    -p <file>            Write process ID (PID) to <file>\n\
    -q                   Don't output any unnecessary text\n\
+   -R <count>           Restart a command that fails, up to <count> times\n\
+                        in a row, keeping its tickets and PAG\n\
    -s                   Read password on standard input\n\
+   -T <margin>          Only run aklog when the AFS token expires in less\n\
+                        than <margin> minutes\n\
    -t                   Get AFS token via aklog or AKLOG\n\
    -U                   Use the first principal in the keytab as the client\n\
                         principal and don't look for a principal on the\n\
                         command line\n\
    -v                   Verbose\n\
+   -W                   Lock the ticket cache while refreshing it so that\n\
+                        other k5start or krenew processes don't also do so\n\
+   -w <policy>          With several commands, exit when any (default) or\n\
+                        all of them have exited\n\
+   -X <realm>           Also get the cross-realm tickets for <realm> along\n\
+                        its path in krb5.conf (may be repeated)\n\
    -x                   Exit immediately on any error\n\
 \n\
 If the environment variable AKLOG (or KINIT_PROG for backward compatibility)\n\
@@ -126,33 +170,293 @@ usage(int status)
 
 
 /*
- * Given the path to a file and the private configuration information, set the
- * owner, group, or mode.  Owner and group may be either the name of a user or
- * group or a numeric UID or GID (as a string).  If the owner is specified as
- * a username (but not if it is specified as a UID), set the GID, if
- * unspecified, to the primary group of that user.
+ * Given the path to a file and a destination, set the owner, group, or mode
+ * of the file to those configured for that destination.
  *
  * Returns an errno on failure and zero on success.
  */
 static krb5_error_code
-set_permissions(const char *file, const struct k5start_private *private)
+set_permissions(const char *file, const struct k5start_dest *dest)
 {
-    if (private->owner != (uid_t) -1 || private->group != (gid_t) -1)
-        if (chown(file, private->owner, private->group) < 0) {
-            syswarn("cannot chown %s to %ld:%ld", file, (long) private->owner,
-                    (long) private->group);
+    if (dest->owner != (uid_t) -1 || dest->group != (gid_t) -1)
+        if (chown(file, dest->owner, dest->group) < 0) {
+            syswarn("cannot chown %s to %ld:%ld", file, (long) dest->owner,
+                    (long) dest->group);
             return errno;
         }
-    if (private->mode != 0)
-        if (chmod(file, private->mode) < 0) {
-            syswarn("cannot chmod %s to %o", file,
-                    (unsigned int) private->mode);
+    if (dest->mode != 0)
+        if (chmod(file, dest->mode) < 0) {
+            syswarn("cannot chmod %s to %o", file, (unsigned int) dest->mode);
             return errno;
         }
     return 0;
 }
 
 
+/*
+ * Store the credentials in the given ticket cache, replacing its contents.
+ * Returns a Kerberos error code on failure after warning about it.
+ */
+static krb5_error_code
+store_creds(krb5_context ctx, const char *cache, krb5_principal client,
+            krb5_creds *creds, size_t ncreds)
+{
+    krb5_ccache ccache;
+    krb5_error_code code;
+    size_t i;
+
+    code = krb5_cc_resolve(ctx, cache, &ccache);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error creating ticket cache");
+        return code;
+    }
+    code = krb5_cc_initialize(ctx, ccache, client);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error initializing ticket cache");
+        goto done;
+    }
+    for (i = 0; i < ncreds && code == 0; i++)
+        code = krb5_cc_store_cred(ctx, ccache, &creds[i]);
+    if (code != 0)
+        warn_krb5(ctx, code, "error storing credentials");
+
+done:
+    krb5_cc_close(ctx, ccache);
+    return code;
+}
+
+
+/*
+ * Store the credentials in a separate temporary ticket cache created with
+ * mkstemp next to the destination, change its ownership, and then rename it
+ * into place.  Returns an error code on failure.
+ */
+static krb5_error_code
+store_tempfile(krb5_context ctx, struct config *config,
+               const struct k5start_dest *dest, krb5_creds *creds,
+               size_t ncreds)
+{
+    krb5_error_code code;
+    int fd;
+    char *tmp;
+
+    xasprintf(&tmp, "%s_XXXXXX", dest->cache);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        code = errno;
+        syswarn("cannot create temporary ticket cache file");
+        free(tmp);
+        return code;
+    }
+    if (fchmod(fd, 0600) < 0) {
+        code = errno;
+        syswarn("cannot chmod temporary ticket cache file");
+        close(fd);
+        goto done;
+    }
+    close(fd);
+    code = store_creds(ctx, tmp, config->client, creds, ncreds);
+    if (code != 0)
+        goto done;
+    code = set_permissions(tmp, dest);
+    if (code != 0)
+        goto done;
+    sync_cache_file(config, tmp);
+    if (rename(tmp, dest->cache) < 0) {
+        code = errno;
+        goto done;
+    }
+    sync_cache_dir(config, dest->cache);
+
+done:
+    /* If we failed, unlink the separate cache. */
+    if (code != 0)
+        unlink(tmp);
+    free(tmp);
+    return code;
+}
+
+
+/*
+ * Store the credentials in one destination ticket cache.  If we aren't
+ * changing ownership or permissions, store the credentials directly in the
+ * ticket cache.  Otherwise, we have to create a separate new ticket cache,
+ * change its ownership, and then move it into place.  Either way, flush it
+ * to disk as configured.
+ */
+static krb5_error_code
+store_dest(krb5_context ctx, struct config *config,
+           const struct k5start_dest *dest, krb5_creds *creds, size_t ncreds)
+{
+    krb5_error_code code;
+
+    if (!dest->set_perms) {
+        code = store_creds(ctx, dest->cache, config->client, creds, ncreds);
+        if (code == 0) {
+            sync_cache_file(config, dest->cache);
+            sync_cache_dir(config, dest->cache);
+        }
+    } else
+        code = store_tempfile(ctx, config, dest, creds, ncreds);
+    return code;
+}
+
+
+/*
+ * Return the realms between one realm and another on the path that
+ * cross-realm authentication takes, as configured in [capaths] in krb5.conf,
+ * as a newly allocated NULL-terminated array.  Without an entry there, or
+ * without the profile library to read it, the path is assumed to be direct
+ * and the array is empty.  Free the result with free_realms.
+ */
+#ifdef HAVE_PROFILE_H
+static char **
+capath(krb5_context ctx, const char *from, const char *to)
+{
+    const char *names[4];
+    profile_t profile;
+    char **values, **path;
+    size_t i, n = 0;
+
+    path = xcalloc(1, sizeof(char *));
+    if (krb5_get_profile(ctx, &profile) != 0)
+        return path;
+    names[0] = "capaths";
+    names[1] = from;
+    names[2] = to;
+    names[3] = NULL;
+    if (profile_get_values(profile, names, &values) == 0) {
+        for (i = 0; values[i] != NULL; i++) {
+            if (strcmp(values[i], ".") == 0)
+                continue;
+            path = xreallocarray(path, n + 2, sizeof(char *));
+            path[n++] = xstrdup(values[i]);
+            path[n] = NULL;
+        }
+        profile_free_list(values);
+    }
+    profile_release(profile);
+    return path;
+}
+#else
+static char **
+capath(krb5_context ctx UNUSED, const char *from UNUSED,
+       const char *to UNUSED)
+{
+    return xcalloc(1, sizeof(char *));
+}
+#endif
+
+
+/*
+ * Free a list of realms returned by capath.
+ */
+static void
+free_realms(char **realms)
+{
+    size_t i;
+
+    for (i = 0; realms[i] != NULL; i++)
+        free(realms[i]);
+    free(realms);
+}
+
+
+/*
+ * Get the ticket-granting ticket for one realm from another using the
+ * tickets in the given ticket cache, and add it to creds unless it's already
+ * there.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+get_crossrealm(krb5_context ctx, struct config *config, krb5_ccache ccache,
+               const char *from, const char *to, krb5_creds **creds,
+               size_t *ncreds)
+{
+    krb5_creds in, *out;
+    krb5_principal server;
+    krb5_error_code code;
+    size_t i;
+
+    code = krb5_build_principal(ctx, &server, strlen(from), from, "krbtgt",
+                                to, (const char *) NULL);
+    if (code != 0)
+        return code;
+    for (i = 0; i < *ncreds; i++)
+        if (krb5_principal_compare(ctx, (*creds)[i].server, server)) {
+            krb5_free_principal(ctx, server);
+            return 0;
+        }
+    memset(&in, 0, sizeof(in));
+    in.client = config->client;
+    in.server = server;
+    code = krb5_get_credentials(ctx, 0, ccache, &in, &out);
+    krb5_free_principal(ctx, server);
+    if (code != 0)
+        return code;
+    if (config->verbose)
+        notice("got cross-realm ticket for krbtgt/%s@%s", to, from);
+    *creds = xreallocarray(*creds, *ncreds + 1, sizeof(krb5_creds));
+    (*creds)[*ncreds] = *out;
+    (*ncreds)++;
+    free(out);
+    return 0;
+}
+
+
+/*
+ * Get the cross-realm ticket-granting tickets for each realm given with -X,
+ * following the path configured for it in krb5.conf from the realm of our
+ * ticket-granting ticket, which is the first of creds.  The tickets are
+ * added to creds so that they're stored in the ticket cache along with the
+ * ticket-granting ticket, and programs using the ticket cache then don't
+ * have to get them on their first request to a service in that realm.
+ * Failures are reported but otherwise ignored, since those programs can
+ * still get the tickets themselves.
+ */
+static void
+prefetch_realms(krb5_context ctx, struct config *config, krb5_creds **creds,
+                size_t *ncreds)
+{
+    struct k5start_private *private = config->private.k5start;
+    krb5_ccache ccache;
+    krb5_error_code code;
+    const char *local, *from;
+    char **path;
+    size_t i, j;
+
+    code = krb5_cc_new_unique(ctx, "MEMORY", NULL, &ccache);
+    if (code == 0)
+        code = krb5_cc_initialize(ctx, ccache, config->client);
+    if (code == 0)
+        code = krb5_cc_store_cred(ctx, ccache, &(*creds)[0]);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error creating memory ticket cache");
+        return;
+    }
+    local = krb5_principal_get_realm(ctx, private->ksprinc);
+    for (i = 0; i < private->nrealms; i++) {
+        if (strcmp(private->realms[i], local) == 0)
+            continue;
+        path = capath(ctx, local, private->realms[i]);
+        from = local;
+        for (j = 0; code == 0 && path[j] != NULL; j++) {
+            code = get_crossrealm(ctx, config, ccache, from, path[j], creds,
+                                  ncreds);
+            from = path[j];
+        }
+        if (code == 0)
+            code = get_crossrealm(ctx, config, ccache, from,
+                                  private->realms[i], creds, ncreds);
+        if (code != 0)
+            warn_krb5(ctx, code, "error getting cross-realm tickets for %s",
+                      private->realms[i]);
+        free_realms(path);
+        code = 0;
+    }
+    krb5_cc_destroy(ctx, ccache);
+}
+
+
 /*
  * Authenticate, given the context and the processed command-line options.
  * Dies on failure.
@@ -164,35 +468,10 @@ authenticate(krb5_context ctx, struct config *config,
     struct k5start_private *private = config->private.k5start;
     krb5_error_code code;
     krb5_keytab keytab = NULL;
-    krb5_creds creds;
-    const char *cache = config->cache;
-    krb5_ccache ccache = NULL;
-    int oerrno;
-
-    /*
-     * If we have owner, group, or mode information, we have to create a
-     * separate temporary ticket cache, change its ownership, and then rename
-     * it.
-     */
-    if (private->set_perms) {
-        int fd;
-        char *tmp;
-
-        xasprintf(&tmp, "%s_XXXXXX", config->cache);
-        fd = mkstemp(tmp);
-        if (fd < 0) {
-            syswarn("cannot create temporary ticket cache file");
-            return errno;
-        }
-        if (fchmod(fd, 0600) < 0) {
-            syswarn("cannot chmod temporary ticket cache file");
-            oerrno = errno;
-            unlink(tmp);
-            return oerrno;
-        }
-        close(fd);
-        cache = tmp;
-    }
+    krb5_creds *creds;
+    size_t ncreds = 1;
+    struct timeval start;
+    size_t i;
 
     /* Verbose logging of what we're doing. */
     if (config->verbose) {
@@ -209,7 +488,7 @@ authenticate(krb5_context ctx, struct config *config,
     }
 
     /* Obtain new credentials. */
-    memset(&creds, 0, sizeof(creds));
+    creds = xcalloc(1, sizeof(krb5_creds));
     if (private->keytab != NULL) {
         code = krb5_kt_resolve(ctx, private->keytab, &keytab);
         if (code != 0) {
@@ -217,11 +496,11 @@ authenticate(krb5_context ctx, struct config *config,
                       private->keytab);
             goto done;
         }
-        code = krb5_get_init_creds_keytab(ctx, &creds, config->client,
+        code = krb5_get_init_creds_keytab(ctx, creds, config->client,
                                           keytab, 0, private->service,
                                           private->kopts);
     } else if (!private->stdin_passwd) {
-        code = krb5_get_init_creds_password(ctx, &creds, config->client,
+        code = krb5_get_init_creds_password(ctx, creds, config->client,
                                             NULL, krb5_prompter_posix, NULL,
                                             0, private->service,
                                             private->kopts);
@@ -243,7 +522,7 @@ authenticate(krb5_context ctx, struct config *config,
             code = KRB5_LIBOS_CANTREADPWD;
             goto done;
         }
-        code = krb5_get_init_creds_password(ctx, &creds, config->client,
+        code = krb5_get_init_creds_password(ctx, creds, config->client,
                                             buffer, NULL, NULL, 0,
                                             private->service,
                                             private->kopts);
@@ -252,60 +531,87 @@ authenticate(krb5_context ctx, struct config *config,
         warn_krb5(ctx, code, "error getting credentials");
         goto done;
     }
-
-    /* Set up the new ticket cache. */
-    code = krb5_cc_resolve(ctx, cache, &ccache);
-    if (code != 0) {
-        warn_krb5(ctx, code, "error creating ticket cache");
-        goto done;
-    }
-    code = krb5_cc_initialize(ctx, ccache, config->client);
-    if (code != 0) {
-        warn_krb5(ctx, code, "error initializing ticket cache");
-        goto done;
-    }
-    code = krb5_cc_store_cred(ctx, ccache, &creds);
-    if (code != 0) {
-        warn_krb5(ctx, code, "error storing credentials");
-        goto done;
-    }
-    krb5_cc_close(ctx, ccache);
-    ccache = NULL;
+    if (private->nrealms > 0)
+        prefetch_realms(ctx, config, &creds, &ncreds);
 
     /*
-     * If we aren't changing ownership or permissions, we're done.  If we are,
-     * set the owner, group, and mode of the resulting cache, and then rename
-     * it into place.
+     * Store the credentials in each destination ticket cache.  Keep going
+     * after a failure so that one bad destination doesn't keep the others
+     * from being updated, but return the first error.
      */
-    if (private->set_perms) {
-        code = set_permissions(cache, private);
-        if (code != 0)
-            goto done;
-        if (rename(cache, config->cache) < 0) {
-            code = errno;
-            goto done;
-        }
+    gettimeofday(&start, NULL);
+    for (i = 0; i < private->ndests; i++) {
+        krb5_error_code err;
+
+        err = store_dest(ctx, config, &private->dests[i], creds, ncreds);
+        if (err != 0 && code == 0)
+            code = err;
     }
+    if (code == 0)
+        report_cache_write(config, &start);
 
 done:
-    /* If we failed and were generating a separate cache, unlink it. */
-    if (private->set_perms)
-        unlink(cache);
-
     /* Make sure that we don't free princ; we use it later. */
-    if (creds.client == config->client)
-        creds.client = NULL;
-    if (cache != config->cache)
-        free((char *) cache);
-    if (ccache != NULL)
-        krb5_cc_close(ctx, ccache);
-    krb5_free_cred_contents(ctx, &creds);
+    if (creds[0].client == config->client)
+        creds[0].client = NULL;
+    for (i = 0; i < ncreds; i++)
+        krb5_free_cred_contents(ctx, &creds[i]);
+    free(creds);
     if (keytab != NULL)
         krb5_kt_close(ctx, keytab);
     return code;
 }
 
 
+/*
+ * Called instead of authenticate when the state file given with -j says that
+ * the existing ticket cache can be trusted on startup.  Copy its credentials
+ * to any additional destination ticket caches given with -O so that they're
+ * refreshed as well.  Errors are only reported, since the next refresh will
+ * store them again.
+ */
+static void
+resume_dests(krb5_context ctx, struct config *config)
+{
+    struct k5start_private *private = config->private.k5start;
+    krb5_ccache ccache;
+    krb5_cc_cursor cursor;
+    krb5_creds *creds = NULL;
+    krb5_error_code code;
+    size_t i, ncreds = 0;
+
+    if (private->ndests < 2)
+        return;
+    code = krb5_cc_resolve(ctx, config->cache, &ccache);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error opening ticket cache %s", config->cache);
+        return;
+    }
+    code = krb5_cc_start_seq_get(ctx, ccache, &cursor);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error reading ticket cache %s", config->cache);
+        krb5_cc_close(ctx, ccache);
+        return;
+    }
+    do {
+        creds = xreallocarray(creds, ncreds + 1, sizeof(krb5_creds));
+        code = krb5_cc_next_cred(ctx, ccache, &cursor, &creds[ncreds]);
+        if (code == 0)
+            ncreds++;
+    } while (code == 0);
+    krb5_cc_end_seq_get(ctx, ccache, &cursor);
+    krb5_cc_close(ctx, ccache);
+    if (code != KRB5_CC_END)
+        warn_krb5(ctx, code, "error reading ticket cache %s", config->cache);
+    else
+        for (i = 1; i < private->ndests; i++)
+            store_dest(ctx, config, &private->dests[i], creds, ncreds);
+    for (i = 0; i < ncreds; i++)
+        krb5_free_cred_contents(ctx, &creds[i]);
+    free(creds);
+}
+
+
 /*
  * Find the principal of the first entry of a keytab and return it as a string
  * in newly allocated memory.  The caller is responsible for freeing the
@@ -347,25 +653,121 @@ first_principal(krb5_context ctx, const char *path)
 /*
  * Strips the cache prefix from the Kerberos ticket cache name if it's a
  * file-based cache.  Otherwise, dies with an error indicating that cache type
- * is not allowed with -o, -g, or -m options.
+ * is not allowed with the options given, which describe how ownership or
+ * permissions were requested.
  */
 static const char *
-strip_cache_prefix(const char *cache)
+strip_cache_prefix(const char *cache, const char *options)
+{
+    const char *path;
+
+    path = cache_path(cache);
+    if (path == NULL)
+        die("cache type %.*s not allowed with %s",
+            (int) (strchr(cache, ':') - cache), cache, options);
+    return path;
+}
+
+
+/*
+ * Convert an owner, given as either the name of a user or a numeric UID, to
+ * a UID.  If the owner was given as a username (but not if it was given as a
+ * UID), also return the primary group of that user in group, and otherwise
+ * set group to -1.  Dies if the user doesn't exist.
+ */
+static uid_t
+parse_owner(const char *owner, gid_t *group)
+{
+    struct passwd *pw;
+    uid_t uid;
+
+    *group = (gid_t) -1;
+    uid = convert_number(owner, 10);
+    if (uid == (uid_t) -1) {
+        pw = getpwnam(owner);
+        if (pw == NULL)
+            die("unknown user %s", owner);
+        uid = pw->pw_uid;
+        *group = pw->pw_gid;
+    }
+    return uid;
+}
+
+
+/*
+ * Convert a group, given as either the name of a group or a numeric GID, to a
+ * GID.  Dies if the group doesn't exist.
+ */
+static gid_t
+parse_group(const char *group)
+{
+    struct group *gr;
+    gid_t gid;
+
+    gid = convert_number(group, 10);
+    if (gid == (gid_t) -1) {
+        gr = getgrnam(group);
+        if (gr == NULL)
+            die("unknown group %s", group);
+        gid = gr->gr_gid;
+    }
+    return gid;
+}
+
+
+/*
+ * Parse the argument to -O, which is of the form:
+ *
+ *     [<owner>]:[<group>]:[<mode>]:<cache>
+ *
+ * and add the resulting destination to the end of the list of destination
+ * ticket caches.  The ticket cache comes last since it may itself contain
+ * colons.  Owner, group, and mode are interpreted as with -o, -g, and -m and
+ * may each be empty to leave that property alone.  Dies on any error.
+ */
+static void
+add_destination(struct k5start_private *private, const char *spec)
 {
-    const char *p;
-
-    if (strncmp(cache, "FILE:", strlen("FILE:")) == 0)
-        return cache + strlen("FILE:");
-    if (strncmp(cache, "WRFILE:", strlen("WRFILE:")) == 0)
-        return cache += strlen("WRFILE:");
-    for (p = cache; *p != '\0'; p++) {
-        if (p > cache && *p == ':')
-            die("cache type %.*s not allowed with -o, -g, or -m",
-                (int) (p - cache), cache);
-        else if (!isupper((unsigned char) *p))
-            return cache;
+    struct k5start_dest *dest;
+    char *owner, *group, *mode, *cache;
+    gid_t primary = (gid_t) -1;
+    long perms;
+
+    owner = xstrdup(spec);
+    group = strchr(owner, ':');
+    mode = (group == NULL) ? NULL : strchr(group + 1, ':');
+    cache = (mode == NULL) ? NULL : strchr(mode + 1, ':');
+    if (cache == NULL || cache[1] == '\0')
+        die("-O destination %s invalid", spec);
+    *group++ = '\0';
+    *mode++ = '\0';
+    *cache++ = '\0';
+
+    /* Allocate the new destination at the end of the array. */
+    private->dests = xreallocarray(private->dests, private->ndests + 1,
+                                   sizeof(struct k5start_dest));
+    dest = &private->dests[private->ndests];
+    private->ndests++;
+    memset(dest, 0, sizeof(*dest));
+    dest->owner = (uid_t) -1;
+    dest->group = (gid_t) -1;
+
+    /* Parse the ownership and permissions and then the ticket cache. */
+    if (owner[0] != '\0')
+        dest->owner = parse_owner(owner, &primary);
+    dest->group = (group[0] != '\0') ? parse_group(group) : primary;
+    if (mode[0] != '\0') {
+        perms = convert_number(mode, 8);
+        if (perms <= 0)
+            die("-O mode %s invalid", mode);
+        dest->mode = perms;
     }
-    return cache;
+    dest->set_perms = (owner[0] != '\0' || group[0] != '\0'
+                       || mode[0] != '\0');
+    if (dest->set_perms)
+        dest->cache = strip_cache_prefix(cache, "-O owner, group, or mode");
+    else
+        dest->cache = cache;
 }
 
 
@@ -374,6 +776,7 @@ main(int argc, char *argv[])
 {
     struct config config;
     struct k5start_private private;
+    struct k5start_dest *dest;
     int opt;
     const char *inst = NULL;
     const char *sname = NULL;
@@ -384,14 +787,15 @@ main(int argc, char *argv[])
     bool nonproxiable = false;
     int lifetime = DEFAULT_LIFETIME;
     krb5_error_code code;
-    struct passwd *pw = NULL;
-    struct group *gr;
+    gid_t primary = (gid_t) -1;
     krb5_context ctx;
     krb5_deltat life_secs;
     bool run_as_daemon;
     bool search_keytab = false;
+    bool wait_given = false;
     static const char optstring[]
-        = "abc:Ff:g:H:hI:i:K:k:Ll:m:no:Pp:qr:S:stUu:vx";
+        = "A:abC:c:D:d:E:e:Ff:G:g:H:hI:i:j:K:k:Ll:M:m:N:nO:o:Pp:qR:r:S:sT:t"
+          "Uu:vWw:X:x";
 
     /* Initialize logging. */
     message_program_name = "k5start";
@@ -400,18 +804,26 @@ main(int argc, char *argv[])
     memset(&config, 0, sizeof(config));
     memset(&private, 0, sizeof(private));
     config.private.k5start = &private;
+    config.argv = argv;
     config.auth = authenticate;
-    private.owner = (uid_t) -1;
-    private.group = (gid_t) -1;
+    config.resume = resume_dests;
+    private.dests = xcalloc(1, sizeof(struct k5start_dest));
+    private.ndests = 1;
+    dest = &private.dests[0];
+    dest->owner = (uid_t) -1;
+    dest->group = (gid_t) -1;
     while ((opt = getopt(argc, argv, optstring)) != EOF)
         switch (opt) {
         case 'a': config.always_renew = true;   break;
         case 'b': config.background = true;     break;
+        case 'C': config.control = optarg;      break;
         case 'c': config.childfile = optarg;    break;
         case 'F': nonforwardable = true;        break;
+        case 'G': config.genfile = optarg;      break;
         case 'h': usage(0);                     break;
         case 'I': sinst = optarg;               break;
         case 'i': inst = optarg;                break;
+        case 'j': config.statefile = optarg;    break;
         case 'k': config.cache = optarg;        break;
         case 'n': /* Ignored */                 break;
         case 'P': nonproxiable = true;          break;
@@ -421,22 +833,28 @@ main(int argc, char *argv[])
         case 'S': sname = optarg;               break;
         case 't': config.do_aklog = true;       break;
         case 'v': config.verbose = true;        break;
+        case 'W': config.lock_cache = true;     break;
         case 'U': search_keytab = true;         break;
         case 'u': principal = optarg;           break;
         case 'x': config.exit_errors = true;    break;
 
+        case 'A':
+            add_shell_command(&config, optarg);
+            break;
+        case 'D':
+            if (!convert_sync_policy(optarg, &config.sync))
+                die("-D policy argument %s invalid", optarg);
+            break;
+        case 'E':
+            if (!convert_pidfile_action(optarg, &config.pidfile_action))
+                die("-E action argument %s invalid", optarg);
+            break;
         case 'f':
             private.keytab = optarg;
             break;
         case 'g':
-            private.group = convert_number(optarg, 10);
-            if (private.group == (gid_t) -1) {
-                gr = getgrnam(optarg);
-                if (gr == NULL)
-                    die("unknown group %s", optarg);
-                private.group = gr->gr_gid;
-            }
-            private.set_perms = true;
+            private.dests[0].group = parse_group(optarg);
+            private.dests[0].set_perms = true;
             break;
         case 'H':
             config.happy_ticket = convert_number(optarg, 10);
@@ -464,21 +882,56 @@ main(int argc, char *argv[])
                 die("bad lifetime value %s, use 10h 10m format", optarg);
             lifetime = life_secs / 60;
             break;
+        case 'M':
+            if (!convert_private_cache(optarg, &config.private_cache))
+                die("-M cache type argument %s invalid", optarg);
+            break;
         case 'm':
-            private.mode = convert_number(optarg, 8);
-            if (private.mode <= 0)
+            private.dests[0].mode = convert_number(optarg, 8);
+            if (private.dests[0].mode <= 0)
                 die("-m mode argument %s invalid", optarg);
-            private.set_perms = true;
+            private.dests[0].set_perms = true;
+            break;
+        case 'N':
+            if (!convert_notify(optarg, &config.notify, &config.notify_signal))
+                die("-N notification argument %s invalid", optarg);
+            break;
+        case 'R':
+            config.restart = convert_number(optarg, 10);
+            if (config.restart <= 0)
+                die("-R restart count argument %s invalid", optarg);
+            break;
+        case 'd':
+            config.aklog_timeout = convert_number(optarg, 10);
+            if (config.aklog_timeout <= 0)
+                die("-d timeout argument %s invalid", optarg);
+            break;
+        case 'e':
+            config.hedge = convert_number(optarg, 10);
+            if (config.hedge <= 0 || config.hedge >= 100)
+                die("-e percentile argument %s invalid", optarg);
+            break;
+        case 'T':
+            config.token_margin = convert_number(optarg, 10);
+            if (config.token_margin <= 0)
+                die("-T margin argument %s invalid", optarg);
+            break;
+        case 'w':
+            if (!convert_wait_policy(optarg, &config.wait))
+                die("-w policy argument %s invalid", optarg);
+            wait_given = true;
+            break;
+        case 'O':
+            add_destination(&private, optarg);
+            break;
+        case 'X':
+            private.realms = xreallocarray(private.realms, private.nrealms + 1,
+                                           sizeof(const char *));
+            private.realms[private.nrealms++] = optarg;
             break;
         case 'o':
-            private.owner = convert_number(optarg, 10);
-            if (private.owner == (uid_t) -1) {
-                pw = getpwnam(optarg);
-                if (pw == NULL)
-                    die("unknown user %s", optarg);
-                private.owner = pw->pw_uid;
-            }
-            private.set_perms = true;
+            private.dests[0].owner = parse_owner(optarg, &primary);
+            private.dests[0].set_perms = true;
             break;
         case 's':
             private.stdin_passwd = true;
@@ -506,7 +959,7 @@ main(int argc, char *argv[])
         argv++;
     }
     if (argv[0] != NULL)
-        config.command = argv;
+        add_command(&config, argv, true);
 
     /* If -x was given, we still want to exit on initial auth failure. */
     if (config.exit_errors)
@@ -516,8 +969,9 @@ main(int argc, char *argv[])
      * If an owner was provided but no group, and the owner was given as a
      * username, set the group to the primary group of that user.
      */
-    if (private.group == (gid_t) -1 && pw != NULL)
-        private.group = pw->pw_gid;
+    dest = &private.dests[0];
+    if (dest->group == (gid_t) -1)
+        dest->group = primary;
 
     /* Check the arguments for consistency. */
     run_as_daemon = (config.keep_ticket != 0 || config.command != NULL);
@@ -527,6 +981,8 @@ main(int argc, char *argv[])
         die("-b option requires a keytab be specified with -f");
     if (config.background && !run_as_daemon)
         die("-b only makes sense with -K or a command to run");
+    if (config.control != NULL && !run_as_daemon)
+        die("-C only makes sense with -K or a command to run");
     if (config.keep_ticket > 0 && private.keytab == NULL)
         die("-K option requires a keytab be specified with -f");
     if (config.command != NULL && private.keytab == NULL)
@@ -544,8 +1000,26 @@ main(int argc, char *argv[])
         die("-H option cannot be used with a command");
     if (config.childfile != NULL && config.command == NULL)
         die("-c option only makes sense with a command to run");
+    if (config.pidfile_action != PIDFILE_OVERWRITE && config.pidfile == NULL)
+        die("-E option requires a PID file with -p");
     if (private.keytab != NULL && private.stdin_passwd)
         die("cannot use both -s and -f flags");
+    if (config.private_cache != PRIVATE_FILE && config.command == NULL)
+        die("-M option only makes sense with a command to run");
+    if (config.notify != NOTIFY_NONE && config.command == NULL)
+        die("-N option only makes sense with a command to run");
+    if (config.restart > 0 && config.command == NULL)
+        die("-R option only makes sense with a command to run");
+    if (wait_given && config.command == NULL)
+        die("-w option only makes sense with a command to run");
+    if (config.token_margin > 0 && !config.do_aklog)
+        die("-T option only makes sense with -t");
+    if (config.aklog_timeout > 0 && !config.do_aklog)
+        die("-d option only makes sense with -t");
+    if (config.private_cache != PRIVATE_FILE && config.cache != NULL)
+        die("cannot use both -M and -k flags");
+    if (private.nrealms > 0 && (sname != NULL || sinst != NULL))
+        die("-X option cannot be used with -S or -I");
 
     /* Establish a Kerberos context. */
     code = krb5_init_context(&ctx);
@@ -568,23 +1042,15 @@ main(int argc, char *argv[])
 
     /*
      * If requested, set a ticket cache.  Otherwise, if we're running a
-     * command, set the ticket cache to a mkstemp-generated file.  Also put it
-     * into the environment in case we're going to run aklog.  Either way, set
-     * up the cache in the Kerberos libraries.
+     * command, create a new private ticket cache, unless we were re-executed
+     * and should keep using the one we already created.  Also put it into the
+     * environment in case we're going to run aklog.  Either way, set up the
+     * cache in the Kerberos libraries.
      */
     if (config.cache == NULL && config.command != NULL) {
-        int fd;
-        char *tmp, *cache;
-
-        xasprintf(&tmp, "/tmp/krb5cc_%d_XXXXXX", (int) getuid());
-        fd = mkstemp(tmp);
-        if (fd < 0)
-            sysdie("cannot create ticket cache file");
-        if (fchmod(fd, 0600) < 0)
-            sysdie("cannot chmod ticket cache file");
-        xasprintf(&cache, "FILE:%s", tmp);
-        free(tmp);
-        config.cache = cache;
+        config.cache = upgrade_cache();
+        if (config.cache == NULL)
+            config.cache = private_cache_create(config.private_cache);
         config.clean_cache = true;
     } else {
         krb5_ccache ccache;
@@ -602,8 +1068,9 @@ main(int argc, char *argv[])
     }
     if (setenv("KRB5CCNAME", config.cache, 1) != 0)
         die("cannot set KRB5CCNAME environment variable");
-    if (private.set_perms)
-        config.cache = strip_cache_prefix(config.cache);
+    if (dest->set_perms)
+        config.cache = strip_cache_prefix(config.cache, "-o, -g, or -m");
+    dest->cache = config.cache;
 
     /*
      * If -K, -H, or -b were given, set quiet automatically unless verbose was
@@ -2,9 +2,10 @@
  * kafs replacement, main API.
  *
  * This is a simple implementation of the k_hasafs, k_setpag, and k_unlog
- * functions.  It is for use on systems that don't have libkafs or
- * libkopenafs, or where a dependency on those libraries is not desirable for
- * some reason.
+ * functions, plus k_tokenexpiry to find when the current tokens expire and
+ * k_capabilities to report what the AFS cache manager supports.  It is for
+ * use on systems that don't have libkafs or libkopenafs, or where a
+ * dependency on those libraries is not desirable for some reason.
  *
  * A more robust implementation of the full kafs interface would have a
  * separate header file with the various system call constants and would
@@ -51,10 +52,31 @@
 #endif
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
 
 /* Used for unused parameters to silence gcc warnings. */
 #define UNUSED __attribute__((__unused__))
 
+/*
+ * The size of the buffer used to retrieve a token.  This has to hold the
+ * encrypted token, which may contain a Kerberos ticket, as well as the clear
+ * token and the cell name.  The out_size member of struct ViceIoctl is a
+ * short, so it can't be larger than 32KB.
+ */
+#define TOKEN_BUFSIZ 16384
+
+/*
+ * The clear part of a token as returned by the get token pioctl.  All
+ * members are 32-bit integers in host byte order except for the session key.
+ */
+struct clear_token {
+    int32_t auth_handle;
+    char session_key[8];
+    int32_t vice_id;
+    int32_t begin;
+    int32_t end;
+};
+
 /* Provided by the relevant sys-*.c file. */
 static int k_syscall(long, long, long, long, long, int *);
 
@@ -97,6 +119,15 @@ static int k_syscall(long, long, long, long, long, int *);
  */
 static volatile sig_atomic_t syscall_okay = 1;
 
+/*
+ * The result of probing the capabilities of the AFS cache manager, and the
+ * process that did the probe.  The probe is repeated in a child process
+ * after fork, since the child may have been started to run something in a
+ * different environment, but is otherwise only done once.
+ */
+static pid_t probe_pid = 0;
+static int probe_result = 0;
+
 
 /*
  * Signal handler to catch failed system calls and change the okay flag.
@@ -133,8 +164,8 @@ k_pioctl(char *path, int cmd, struct ViceIoctl *cmarg, int follow)
  * This just attempts the set token system call with an empty token structure,
  * which will be a no-op in the kernel.
  */
-int
-k_hasafs(void)
+static int
+probe_hasafs(void)
 {
     struct ViceIoctl iob;
     int rval, saved_errno, okay;
@@ -162,6 +193,59 @@ k_hasafs(void)
 }
 
 
+/*
+ * Return the capabilities of the AFS cache manager as a set of KAFS_CAP_*
+ * flags, probing it the first time this is called in a process.  If AFS is
+ * available at all, setpag is done through the same system call interface,
+ * so it's assumed to work.  The get PAG and get token pioctls are tried to
+ * see if they are supported.  For the latter, running out of tokens or
+ * space for the token still means that it's supported.
+ */
+int
+k_capabilities(void)
+{
+    struct ViceIoctl iob;
+    uint32_t pag;
+    int32_t index = 0;
+    char buffer[16];
+    int saved_errno, caps = 0;
+
+    if (probe_pid == getpid())
+        return probe_result;
+    saved_errno = errno;
+    if (probe_hasafs()) {
+        caps |= KAFS_CAP_AFS | KAFS_CAP_SETPAG;
+        iob.in = NULL;
+        iob.in_size = 0;
+        iob.out = (void *) &pag;
+        iob.out_size = sizeof(pag);
+        if (k_pioctl(NULL, _IOW('C', 13, struct ViceIoctl), &iob, 0) == 0)
+            caps |= KAFS_CAP_GETPAG;
+        iob.in = (void *) &index;
+        iob.in_size = sizeof(index);
+        iob.out = buffer;
+        iob.out_size = sizeof(buffer);
+        if (k_pioctl(NULL, _IOW('V', 8, struct ViceIoctl), &iob, 0) == 0
+            || errno == EDOM || errno == E2BIG)
+            caps |= KAFS_CAP_TOKENS;
+    }
+    errno = saved_errno;
+    probe_result = caps;
+    probe_pid = getpid();
+    return caps;
+}
+
+
+/*
+ * Returns true if AFS is available, using the cached probe.
+ */
+int
+k_hasafs(void)
+{
+    return (k_capabilities() & KAFS_CAP_AFS) != 0;
+}
+
+
 /*
  * The setpag system call.  This is special in that it's not a pioctl;
  * instead, it's a separate system call done directly through the afs_syscall
@@ -193,3 +277,67 @@ k_unlog(void)
     iob.out_size = 0;
     return k_pioctl(NULL, _IOW('V', 9, struct ViceIoctl), &iob, 0);
 }
+
+
+/*
+ * Find when the tokens in the current PAG expire.  Walks through the tokens
+ * with the get token pioctl, which takes the index of the token and returns
+ * the length of the encrypted token, the encrypted token, the length of the
+ * clear token, the clear token, and then the primary flag and cell name,
+ * which we don't need.  Stores the earliest expiration time of all of the
+ * tokens in the provided argument and returns 0 on success, or returns -1
+ * with errno set on failure.  If there are no tokens, errno is set to ENOENT.
+ */
+int
+k_tokenexpiry(time_t *expires)
+{
+    struct ViceIoctl iob;
+    struct clear_token clear;
+    char *buffer;
+    int32_t index, length;
+    size_t offset;
+    int saved_errno;
+    bool found = false;
+
+    if (!(k_capabilities() & KAFS_CAP_TOKENS)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    buffer = malloc(TOKEN_BUFSIZ);
+    if (buffer == NULL)
+        return -1;
+    for (index = 0; ; index++) {
+        iob.in = (void *) &index;
+        iob.in_size = sizeof(index);
+        iob.out = buffer;
+        iob.out_size = TOKEN_BUFSIZ;
+        if (k_pioctl(NULL, _IOW('V', 8, struct ViceIoctl), &iob, 0) != 0) {
+            if (errno == EDOM)
+                break;
+            saved_errno = errno;
+            free(buffer);
+            errno = saved_errno;
+            return -1;
+        }
+
+        /* Skip over the encrypted token and find the clear token. */
+        memcpy(&length, buffer, sizeof(length));
+        if (length < 0 || length > TOKEN_BUFSIZ - 2 * (int32_t) sizeof(length))
+            continue;
+        offset = sizeof(length) + length;
+        memcpy(&length, buffer + offset, sizeof(length));
+        offset += sizeof(length);
+        if (length != sizeof(clear) || offset + length > TOKEN_BUFSIZ)
+            continue;
+        memcpy(&clear, buffer + offset, sizeof(clear));
+        if (!found || clear.end < *expires)
+            *expires = clear.end;
+        found = true;
+    }
+    free(buffer);
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
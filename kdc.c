@@ -0,0 +1,1045 @@
+/*
+ * Hooks into KDC communication for k5start and krenew.
+ *
+ * With Kerberos libraries that let the application see each request before
+ * it is sent to the KDC (MIT Kerberos 1.15 and later), k5start and krenew
+ * install a hook that refuses to send further requests once the current
+ * refresh cycle has used up the time it was given for talking to the KDC.
+ * The Kerberos libraries have no way to cancel a request once it has been
+ * sent, and looking up the KDC's address isn't bounded either, so this is
+ * only a best-effort limit.  But a refresh usually takes several requests
+ * (for preauthentication and referrals, for example), so this keeps one slow
+ * KDC from using up the whole remaining lifetime of the tickets.  The
+ * framework then retries the refresh later.  With -e, waiting for the reply
+ * is bounded by the same deadline.
+ *
+ * With -e, the same hook also sends each request itself.  It sends the
+ * request to the first KDC configured for the realm in krb5.conf and, if
+ * that KDC hasn't replied by the given percentile of the recent reply times,
+ * also sends it to the next KDC, and so on, taking whichever reply arrives
+ * first.  This keeps one slow KDC from slowing down every refresh.  Requests
+ * are sent over UDP unless they're too large for it or the KDC is configured
+ * with tcp/, in which case a new TCP connection is made for each request,
+ * as MIT and Heimdal KDCs close it after each reply anyway.  Anything that
+ * this simple exchange can't handle, such as KDCs found through DNS or no
+ * reply at all, is left to the Kerberos libraries.
+ *
+ * Rather than always starting with the first KDC, as the Kerberos libraries
+ * do, this exchange keeps track of how quickly each KDC replies and how
+ * often it fails, tries the healthiest KDC first, and saves that information
+ * in the state file so that it survives restarts.
+ *
+ * With other Kerberos libraries, these functions do nothing.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#include <time.h>
+
+/* Hedging requests needs the send hook and the profile library. */
+#if defined(HAVE_KRB5_SET_KDC_SEND_HOOK) && defined(HAVE_PROFILE_H)
+# define HAVE_KDC_HEDGE 1
+#endif
+
+#ifdef HAVE_KDC_HEDGE
+# include <fcntl.h>
+# include <netdb.h>
+# include <profile.h>
+# include <sys/socket.h>
+#endif
+
+#include <internal.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/*
+ * Some systems don't have MSG_NOSIGNAL.  Those that don't generally have
+ * SO_NOSIGPIPE instead, which is set on each TCP connection to a KDC.
+ */
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/* When to stop sending requests to the KDC, or 0 for no limit. */
+static time_t deadline = 0;
+
+#ifdef HAVE_KDC_HEDGE
+
+/*
+ * How many recent reply times the -e percentile is taken from, how many are
+ * needed before using it, and how long to wait before trying the next KDC
+ * until then, in milliseconds.
+ */
+# define HEDGE_SAMPLES     64
+# define HEDGE_MIN_SAMPLES 8
+# define HEDGE_DEFAULT     1000
+
+/* How long to wait for any reply before giving up, in milliseconds. */
+# define HEDGE_TIMEOUT 10000
+
+/*
+ * The default for udp_preference_limit in krb5.conf, the size above which
+ * requests are sent over TCP, and the largest value it can have.  Replies
+ * over UDP can't be longer than UDP_REPLY_MAX, and we don't accept replies
+ * over TCP longer than TCP_REPLY_MAX.
+ */
+# define UDP_LIMIT      1465
+# define UDP_LIMIT_MAX  32700
+# define UDP_REPLY_MAX  65536
+# define TCP_REPLY_MAX  (1024 * 1024)
+
+/* KRB-ERROR codes that need special handling. */
+# define KDC_ERR_SVC_UNAVAILABLE  29
+# define KRB_ERR_RESPONSE_TOO_BIG 52
+
+/*
+ * The health of each KDC we've sent requests to, which is saved in the state
+ * file given with -j.  The reply time and failure rate are moving averages
+ * in which each new observation gets a quarter of the weight, and the
+ * failure rate is in tenths of a percent.
+ */
+struct kdc_stats {
+    char *realm;                /* Realm of the KDC. */
+    char *host;                 /* Host and port as configured. */
+    unsigned long rtt;          /* Average reply time in milliseconds. */
+    unsigned long fail_rate;    /* Average failure rate. */
+    unsigned long replies;      /* Total replies received. */
+    unsigned long failures;     /* Total failures. */
+};
+
+/* A KDC from krb5.conf. */
+struct kdc {
+    char *host;                 /* Host and port as configured. */
+    bool tcp;                   /* Whether it was configured with tcp/. */
+    struct sockaddr_storage addr; /* Address to send requests to. */
+    socklen_t addrlen;          /* Length of that address. */
+    size_t stats;               /* Index of its health in stats. */
+};
+
+/* A realm and its KDCs, loaded from krb5.conf when first needed. */
+struct realm {
+    char *name;                 /* Name of the realm. */
+    struct kdc *kdcs;           /* Its KDCs in configured order. */
+    size_t nkdcs;               /* Count of KDCs. */
+};
+
+/* A request sent to one KDC. */
+struct attempt {
+    struct kdc *kdc;            /* KDC the request was sent to. */
+    int fd;                     /* Socket, or -1 when done with it. */
+    bool tcp;                   /* Whether fd is a TCP connection. */
+    bool connecting;            /* Still waiting for the TCP connection. */
+    unsigned char *request;     /* TCP request with its length, if any. */
+    size_t request_length;      /* Length of the TCP request. */
+    size_t request_sent;        /* Bytes of the TCP request sent so far. */
+    struct timeval sent;        /* When the request was sent. */
+    unsigned char *reply;       /* TCP reply with its length, if any. */
+    size_t have;                /* Bytes of the TCP reply read so far. */
+    size_t want;                /* Bytes of the TCP reply expected. */
+};
+
+/* All the realms we've loaded. */
+static struct realm *realms = NULL;
+static size_t nrealms = 0;
+
+/* Requests longer than this are sent over TCP. */
+static size_t udp_limit = UDP_LIMIT;
+
+/* The health of all KDCs we know about. */
+static struct kdc_stats *stats = NULL;
+static size_t nstats = 0;
+
+/*
+ * The -e percentile, or 0 to let the Kerberos libraries send requests, and
+ * whether to report which KDC answered each request.
+ */
+static int hedge = 0;
+static bool verbose = false;
+
+/* Recent reply times in milliseconds, as a ring buffer. */
+static unsigned long samples[HEDGE_SAMPLES];
+static size_t nsamples = 0;
+static size_t next_sample = 0;
+
+
+/*
+ * Find the health of a KDC, adding a new entry with no history if we don't
+ * know anything about it yet.  Returns its index in the stats array.
+ */
+static size_t
+stats_find(const char *realm, const char *host)
+{
+    size_t i;
+
+    for (i = 0; i < nstats; i++)
+        if (strcmp(stats[i].realm, realm) == 0
+            && strcmp(stats[i].host, host) == 0)
+            return i;
+    stats = xreallocarray(stats, nstats + 1, sizeof(struct kdc_stats));
+    memset(&stats[nstats], 0, sizeof(struct kdc_stats));
+    stats[nstats].realm = xstrdup(realm);
+    stats[nstats].host = xstrdup(host);
+    return nstats++;
+}
+
+
+/*
+ * Record a reply from a KDC after the given number of milliseconds.
+ */
+static void
+stats_reply(const struct kdc *kdc, unsigned long rtt)
+{
+    struct kdc_stats *s = &stats[kdc->stats];
+
+    s->rtt = (s->replies == 0) ? rtt : (3 * s->rtt + rtt) / 4;
+    s->fail_rate = 3 * s->fail_rate / 4;
+    s->replies++;
+}
+
+
+/*
+ * Record that a KDC couldn't be reached, sent an unusable reply, or never
+ * replied.
+ */
+static void
+stats_failure(const struct kdc *kdc)
+{
+    struct kdc_stats *s = &stats[kdc->stats];
+
+    s->fail_rate = (3 * s->fail_rate + 1000) / 4;
+    s->failures++;
+}
+
+
+/*
+ * Record that a KDC still hadn't replied after the given number of
+ * milliseconds when another KDC did, which counts as a reply that slow if
+ * that's slower than its average.
+ */
+static void
+stats_slow(const struct kdc *kdc, unsigned long rtt)
+{
+    struct kdc_stats *s = &stats[kdc->stats];
+
+    if (rtt > s->rtt)
+        s->rtt = (3 * s->rtt + rtt) / 4;
+}
+
+
+/*
+ * Return the order in which to try the KDCs of a realm as a newly allocated
+ * array of indices into its kdcs.  KDCs are ordered by their average reply
+ * time plus the time a failure costs weighted by their failure rate, keeping
+ * the configured order for ties, so KDCs we know nothing about yet are tried
+ * first.
+ */
+static size_t *
+kdcs_order(const struct realm *realm)
+{
+    size_t *order;
+    unsigned long *score;
+    unsigned long key;
+    size_t i, j, index;
+
+    order = xcalloc(realm->nkdcs, sizeof(size_t));
+    score = xcalloc(realm->nkdcs, sizeof(unsigned long));
+    for (i = 0; i < realm->nkdcs; i++) {
+        index = realm->kdcs[i].stats;
+        key = stats[index].rtt
+            + stats[index].fail_rate * (HEDGE_TIMEOUT / 1000);
+        for (j = i; j > 0 && score[j - 1] > key; j--) {
+            score[j] = score[j - 1];
+            order[j] = order[j - 1];
+        }
+        score[j] = key;
+        order[j] = i;
+    }
+    free(score);
+    return order;
+}
+
+
+/*
+ * Parse one kdc setting from krb5.conf and resolve it, adding it to the KDCs
+ * of a realm.  KDCs may be reached over UDP or TCP, but proxies and hosts
+ * that can't be resolved are skipped.
+ */
+static void
+kdcs_add(struct realm *realm, const char *value)
+{
+    struct addrinfo hints, *ai;
+    struct kdc *kdc;
+    char *host, *port, *end;
+    bool tcp = false;
+
+    if (strstr(value, "://") != NULL)
+        return;
+    if (strncmp(value, "tcp/", 4) == 0) {
+        host = xstrdup(value + 4);
+        tcp = true;
+    } else if (strncmp(value, "udp/", 4) == 0)
+        host = xstrdup(value + 4);
+    else
+        host = xstrdup(value);
+    port = NULL;
+    if (host[0] == '[') {
+        end = strchr(host, ']');
+        if (end == NULL) {
+            free(host);
+            return;
+        }
+        *end = '\0';
+        if (end[1] == ':')
+            port = end + 2;
+        memmove(host, host + 1, strlen(host + 1) + 1);
+    } else {
+        port = strchr(host, ':');
+        if (port != NULL)
+            *port++ = '\0';
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
+    if (getaddrinfo(host, port == NULL ? "88" : port, &hints, &ai) != 0) {
+        free(host);
+        return;
+    }
+    realm->kdcs = xreallocarray(realm->kdcs, realm->nkdcs + 1,
+                                sizeof(struct kdc));
+    kdc = &realm->kdcs[realm->nkdcs++];
+    memset(kdc, 0, sizeof(*kdc));
+    kdc->host = xstrdup(value);
+    kdc->tcp = tcp;
+    kdc->stats = stats_find(realm->name, value);
+    memcpy(&kdc->addr, ai->ai_addr, ai->ai_addrlen);
+    kdc->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    free(host);
+}
+
+
+/*
+ * Return a realm with its KDCs, loading them from krb5.conf if this is the
+ * first time we've seen it.
+ */
+static struct realm *
+realm_load(krb5_context ctx, const krb5_data *name)
+{
+    struct realm *realm;
+    const char *names[4];
+    profile_t profile;
+    char **values;
+    size_t i;
+
+    for (i = 0; i < nrealms; i++)
+        if (strlen(realms[i].name) == name->length
+            && memcmp(realms[i].name, name->data, name->length) == 0)
+            return &realms[i];
+    realms = xreallocarray(realms, nrealms + 1, sizeof(struct realm));
+    realm = &realms[nrealms++];
+    memset(realm, 0, sizeof(*realm));
+    realm->name = xstrndup(name->data, name->length);
+    if (krb5_get_profile(ctx, &profile) != 0)
+        return realm;
+    names[0] = "realms";
+    names[1] = realm->name;
+    names[2] = "kdc";
+    names[3] = NULL;
+    if (profile_get_values(profile, names, &values) == 0) {
+        for (i = 0; values[i] != NULL; i++)
+            kdcs_add(realm, values[i]);
+        profile_free_list(values);
+    }
+    profile_release(profile);
+    return realm;
+}
+
+
+/*
+ * Compare two reply times, for qsort.
+ */
+static int
+compare_samples(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+
+/*
+ * Return how long to wait for a KDC to reply before also sending the request
+ * to the next one, in milliseconds: the -e percentile of the recent reply
+ * times, or HEDGE_DEFAULT until there are enough of them.
+ */
+static unsigned long
+hedge_delay(void)
+{
+    unsigned long sorted[HEDGE_SAMPLES];
+    size_t i;
+
+    if (nsamples < HEDGE_MIN_SAMPLES)
+        return HEDGE_DEFAULT;
+    memcpy(sorted, samples, nsamples * sizeof(unsigned long));
+    qsort(sorted, nsamples, sizeof(unsigned long), compare_samples);
+    i = nsamples * hedge / 100;
+    if (i >= nsamples)
+        i = nsamples - 1;
+    return (sorted[i] > 0) ? sorted[i] : 1;
+}
+
+
+/*
+ * Return the milliseconds since the given time.
+ */
+static unsigned long
+elapsed(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+
+/*
+ * Parse a DER tag and length, advancing the pointer past them.  Returns the
+ * length of the contents or -1 if they don't fit in the remaining data.
+ */
+static ssize_t
+der_header(const unsigned char **p, const unsigned char *end,
+           unsigned char *tag)
+{
+    size_t length, n;
+
+    if (end - *p < 2)
+        return -1;
+    *tag = *(*p)++;
+    length = *(*p)++;
+    if (length & 0x80) {
+        n = length & 0x7f;
+        if (n == 0 || n > 4 || (size_t) (end - *p) < n)
+            return -1;
+        for (length = 0; n > 0; n--)
+            length = (length << 8) | *(*p)++;
+    }
+    if (length > (size_t) (end - *p))
+        return -1;
+    return length;
+}
+
+
+/*
+ * Check a reply from a KDC.  Returns 1 if it should be returned to the
+ * Kerberos libraries, 0 if it should be ignored so that we keep waiting for
+ * another KDC, and -1 if the request should be sent again over TCP.  A
+ * KRB-ERROR saying that the KDC is unavailable is ignored, as the Kerberos
+ * libraries do, and one saying that the reply is too big for UDP means the
+ * request should be sent again over TCP.
+ */
+static int
+reply_check(const unsigned char *reply, size_t length)
+{
+    const unsigned char *p = reply;
+    const unsigned char *end = reply + length;
+    unsigned char tag;
+    ssize_t size;
+    long code;
+
+    if (length == 0)
+        return 0;
+
+    /* AS-REP and TGS-REP are always accepted. */
+    if (reply[0] == 0x6b || reply[0] == 0x6d)
+        return 1;
+    if (reply[0] != 0x7e)
+        return 0;
+
+    /* Find error-code, which is [6], in the KRB-ERROR SEQUENCE. */
+    if (der_header(&p, end, &tag) < 0 || der_header(&p, end, &tag) < 0)
+        return 0;
+    if (tag != 0x30)
+        return 0;
+    while (p < end) {
+        size = der_header(&p, end, &tag);
+        if (size < 0)
+            return 0;
+        if (tag != 0xa6) {
+            p += size;
+            continue;
+        }
+        size = der_header(&p, end, &tag);
+        if (size < 1 || size > 4 || tag != 0x02)
+            return 0;
+        code = (p[0] & 0x80) ? -1 : 0;
+        for (; size > 0; size--)
+            code = (code << 8) | *p++;
+        if (code == KDC_ERR_SVC_UNAVAILABLE)
+            return 0;
+        if (code == KRB_ERR_RESPONSE_TOO_BIG)
+            return -1;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Send as much of the rest of a TCP request as the socket will take without
+ * blocking.  Returns false if the connection failed.
+ */
+static bool
+attempt_flush(struct attempt *a)
+{
+    ssize_t status;
+
+    while (a->request_sent < a->request_length) {
+        status = send(a->fd, a->request + a->request_sent,
+                      a->request_length - a->request_sent, MSG_NOSIGNAL);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0 && errno == EAGAIN)
+            return true;
+# if EAGAIN != EWOULDBLOCK
+        if (status < 0 && errno == EWOULDBLOCK)
+            return true;
+# endif
+        if (status <= 0)
+            return false;
+        a->request_sent += status;
+    }
+    return true;
+}
+
+
+/*
+ * Send a request over an attempt's socket, with the four-byte length that
+ * Kerberos puts in front of each message over TCP.  If the TCP socket won't
+ * take all of it at once, the rest is sent by attempt_write when the socket
+ * is writable.  Returns false if the request couldn't be sent.
+ */
+static bool
+attempt_send(struct attempt *a, const krb5_data *message)
+{
+    unsigned char *buffer;
+
+    if (!a->tcp)
+        return send(a->fd, message->data, message->length, 0) >= 0;
+    free(a->request);
+    a->request_length = message->length + 4;
+    a->request_sent = 0;
+    buffer = xmalloc(a->request_length);
+    buffer[0] = (message->length >> 24) & 0xff;
+    buffer[1] = (message->length >> 16) & 0xff;
+    buffer[2] = (message->length >> 8) & 0xff;
+    buffer[3] = message->length & 0xff;
+    memcpy(buffer + 4, message->data, message->length);
+    a->request = buffer;
+    return attempt_flush(a);
+}
+
+
+/*
+ * Returns true if an attempt is waiting for its socket to become writable,
+ * either to finish connecting or to send the rest of its request.
+ */
+static bool
+attempt_writing(const struct attempt *a)
+{
+    return a->connecting || a->request_sent < a->request_length;
+}
+
+
+/*
+ * Continue an attempt after select says its socket is writable, sending the
+ * request once the TCP connection is made or sending more of it.  Returns
+ * false if the connection failed.
+ */
+static bool
+attempt_write(struct attempt *a, const krb5_data *message)
+{
+    socklen_t size;
+    int error;
+
+    if (!a->connecting)
+        return attempt_flush(a);
+    a->connecting = false;
+    size = sizeof(error);
+    if (getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &error, &size) < 0)
+        return false;
+    if (error != 0)
+        return false;
+    return attempt_send(a, message);
+}
+
+
+/*
+ * Start a request to a KDC over UDP or TCP.  Over TCP, the connection is
+ * made without waiting for it, and the request is sent once it's connected.
+ * Returns false if the request couldn't be started.
+ */
+static bool
+attempt_start(struct attempt *a, struct kdc *kdc, const krb5_data *message,
+              bool tcp)
+{
+    int fd, flags;
+# ifdef SO_NOSIGPIPE
+    int on = 1;
+# endif
+
+    memset(a, 0, sizeof(*a));
+    a->kdc = kdc;
+    a->tcp = tcp;
+    a->fd = -1;
+    gettimeofday(&a->sent, NULL);
+    fd = socket(kdc->addr.ss_family, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    a->fd = fd;
+    if (fd < 0)
+        return false;
+    if (fd >= FD_SETSIZE || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+        goto fail;
+    if (tcp) {
+        flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+            goto fail;
+# ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+# endif
+    }
+    if (connect(fd, (const struct sockaddr *) &kdc->addr, kdc->addrlen) < 0) {
+        if (!tcp || errno != EINPROGRESS)
+            goto fail;
+        a->connecting = true;
+        return true;
+    }
+    if (attempt_send(a, message))
+        return true;
+
+fail:
+    close(fd);
+    a->fd = -1;
+    return false;
+}
+
+
+/*
+ * Read from an attempt's socket after select says it's readable.  Returns 1
+ * and sets reply and length to the reply once all of it has been read, 0 if
+ * more of a TCP reply is still to come, and -1 if the KDC closed the
+ * connection or there was an error.  A UDP reply is read into buffer, which
+ * must hold UDP_REPLY_MAX bytes.
+ */
+static int
+attempt_read(struct attempt *a, unsigned char *buffer,
+             const unsigned char **reply, size_t *length)
+{
+    unsigned long size;
+    ssize_t status;
+
+    if (!a->tcp) {
+        status = recv(a->fd, buffer, UDP_REPLY_MAX, 0);
+        if (status < 0)
+            return -1;
+        *reply = buffer;
+        *length = status;
+        return 1;
+    }
+    if (a->want == 0) {
+        a->want = 4;
+        a->reply = xmalloc(a->want);
+    }
+    status = recv(a->fd, a->reply + a->have, a->want - a->have, 0);
+    if (status < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (status <= 0)
+        return -1;
+    a->have += status;
+    if (a->have < a->want)
+        return 0;
+    if (a->have == 4) {
+        size = ((unsigned long) a->reply[0] << 24)
+            | ((unsigned long) a->reply[1] << 16)
+            | ((unsigned long) a->reply[2] << 8) | a->reply[3];
+        if (size > TCP_REPLY_MAX)
+            return -1;
+        a->want = size + 4;
+        a->reply = xrealloc(a->reply, a->want);
+        if (size > 0)
+            return 0;
+    }
+    *reply = a->reply + 4;
+    *length = a->want - 4;
+    return 1;
+}
+
+
+/*
+ * Finish with an attempt, closing its socket.
+ */
+static void
+attempt_done(struct attempt *a)
+{
+    if (a->fd >= 0)
+        close(a->fd);
+    a->fd = -1;
+    free(a->request);
+    a->request = NULL;
+    free(a->reply);
+    a->reply = NULL;
+}
+
+
+/*
+ * Send a request to the KDCs of a realm, healthiest first, moving on to the
+ * next each time the hedge delay passes without a reply, and store the first
+ * usable reply in newly allocated memory.  Requests too large for UDP and
+ * requests to KDCs configured with tcp/ are sent over TCP, as is a request
+ * that a KDC says has a reply too big for UDP.  The health of each KDC we
+ * sent to is updated with how it did.  Returns ETIMEDOUT if the deadline
+ * passed first, since the Kerberos libraries would send the request again
+ * without any bound, and otherwise 0, leaving reply unset if the request
+ * should be left to the Kerberos libraries.
+ */
+static krb5_error_code
+hedged_send(krb5_context ctx, const struct realm *realm,
+            const krb5_data *message, krb5_data **reply)
+{
+    struct attempt *attempts, *a;
+    struct kdc *kdc;
+    struct timeval start, timeout;
+    unsigned char *buffer;
+    const unsigned char *data;
+    unsigned long delay, now, next, limit, wait, rtt;
+    size_t i, length, nsent = 0, open = 0;
+    size_t *order;
+    krb5_data result;
+    fd_set readfds, writefds;
+    int maxfd, status;
+    bool tcp, retry;
+    bool done = false;
+    bool fallback = false;
+    bool bounded = false;
+    bool expired = false;
+
+    order = kdcs_order(realm);
+    attempts = xcalloc(realm->nkdcs, sizeof(struct attempt));
+    buffer = xmalloc(UDP_REPLY_MAX);
+    gettimeofday(&start, NULL);
+    delay = hedge_delay();
+    limit = HEDGE_TIMEOUT;
+    if (deadline != 0) {
+        bounded = true;
+        if (deadline <= start.tv_sec)
+            limit = 0;
+        else if (deadline - start.tv_sec < HEDGE_TIMEOUT / 1000)
+            limit = (deadline - start.tv_sec) * 1000;
+        else
+            bounded = false;
+    }
+    next = 0;
+    while (!done && !fallback) {
+        now = elapsed(&start);
+        if (now >= limit) {
+            expired = bounded;
+            break;
+        }
+
+        /*
+         * Send to the next KDC when its turn comes or right away if all the
+         * KDCs we've sent to have failed.
+         */
+        if (nsent < realm->nkdcs && (now >= next || open == 0)) {
+            kdc = &realm->kdcs[order[nsent]];
+            tcp = (kdc->tcp || message->length > udp_limit);
+            if (attempt_start(&attempts[nsent], kdc, message, tcp))
+                open++;
+            else
+                stats_failure(kdc);
+            nsent++;
+            next = now + delay;
+            continue;
+        }
+        if (open == 0)
+            break;
+
+        /*
+         * Wait for a reply, or for a TCP connection to be made, until the
+         * next KDC is due.
+         */
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        maxfd = -1;
+        for (i = 0; i < nsent; i++) {
+            a = &attempts[i];
+            if (a->fd < 0)
+                continue;
+            FD_SET(a->fd, attempt_writing(a) ? &writefds : &readfds);
+            if (a->fd > maxfd)
+                maxfd = a->fd;
+        }
+        wait = ((nsent < realm->nkdcs && next < limit) ? next : limit) - now;
+        timeout.tv_sec = wait / 1000;
+        timeout.tv_usec = (wait % 1000) * 1000;
+        if (select(maxfd + 1, &readfds, &writefds, NULL, &timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        /*
+         * Take the first usable reply.  A KDC whose reply we're ignoring or
+         * that can't be reached is dropped and counted as a failure.
+         */
+        for (i = 0; i < nsent && !done && !fallback; i++) {
+            a = &attempts[i];
+            kdc = a->kdc;
+            if (a->fd < 0)
+                continue;
+            if (attempt_writing(a)) {
+                if (!FD_ISSET(a->fd, &writefds))
+                    continue;
+                if (attempt_write(a, message))
+                    continue;
+                status = -1;
+            } else {
+                if (!FD_ISSET(a->fd, &readfds))
+                    continue;
+                status = attempt_read(a, buffer, &data, &length);
+                if (status == 0)
+                    continue;
+            }
+
+            /*
+             * If the reply is too big for UDP, try the same KDC again over
+             * TCP.
+             */
+            retry = false;
+            if (status > 0) {
+                status = reply_check(data, length);
+                retry = (status < 0 && !a->tcp);
+            }
+            if (retry) {
+                attempt_done(a);
+                if (attempt_start(a, kdc, message, true))
+                    continue;
+                open--;
+                stats_failure(kdc);
+                continue;
+            }
+            if (status <= 0) {
+                attempt_done(a);
+                open--;
+                stats_failure(kdc);
+                continue;
+            }
+            rtt = elapsed(&a->sent);
+            stats_reply(kdc, rtt);
+            if (verbose)
+                notice("KDC %s replied in %lu ms", kdc->host, rtt);
+            samples[next_sample] = rtt;
+            next_sample = (next_sample + 1) % HEDGE_SAMPLES;
+            if (nsamples < HEDGE_SAMPLES)
+                nsamples++;
+            result.data = (char *) data;
+            result.length = length;
+            if (krb5_copy_data(ctx, &result, reply) == 0)
+                done = true;
+            else
+                fallback = true;
+            attempt_done(a);
+            open--;
+        }
+    }
+
+    /*
+     * A KDC that was beaten by another is at least as slow as the time it
+     * has had so far.  One that never replied when nobody else did either
+     * has failed.
+     */
+    for (i = 0; i < nsent; i++) {
+        a = &attempts[i];
+        if (a->fd >= 0) {
+            if (done)
+                stats_slow(a->kdc, elapsed(&a->sent));
+            else if (!fallback)
+                stats_failure(a->kdc);
+        }
+        attempt_done(a);
+    }
+    free(order);
+    free(attempts);
+    free(buffer);
+    return expired ? ETIMEDOUT : 0;
+}
+
+
+/*
+ * Parse a kdc line from the state file, without the leading key, and add the
+ * health of the KDC that it records.  Invalid lines are ignored.
+ */
+static void
+stats_parse(char *value)
+{
+    char *field[6];
+    unsigned long number[4];
+    char *end;
+    size_t i, n;
+
+    for (n = 0; n < 6 && value != NULL; n++) {
+        field[n] = value;
+        value = strchr(value, ' ');
+        if (value != NULL)
+            *value++ = '\0';
+    }
+    if (n < 6 || value != NULL)
+        return;
+    for (i = 0; i < 4; i++) {
+        errno = 0;
+        number[i] = strtoul(field[i + 2], &end, 10);
+        if (errno != 0 || end == field[i + 2] || *end != '\0'
+            || field[i + 2][0] == '-')
+            return;
+    }
+    i = stats_find(field[0], field[1]);
+    stats[i].rtt = number[0];
+    stats[i].fail_rate = (number[1] > 1000) ? 1000 : number[1];
+    stats[i].replies = number[2];
+    stats[i].failures = number[3];
+}
+
+
+/*
+ * Load the health of the KDCs from the kdc lines of the state file, if it
+ * exists.  Problems with the state file are reported when the framework
+ * reads it, so they're ignored here.
+ */
+static void
+stats_read(const char *path)
+{
+    FILE *file;
+    char buffer[BUFSIZ];
+    char *end;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return;
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        end = strchr(buffer, '\n');
+        if (end == NULL)
+            break;
+        *end = '\0';
+        if (strncmp(buffer, "kdc ", 4) == 0)
+            stats_parse(buffer + 4);
+    }
+    fclose(file);
+}
+
+#endif /* HAVE_KDC_HEDGE */
+
+
+#ifdef HAVE_KRB5_SET_KDC_SEND_HOOK
+
+/*
+ * Called by the Kerberos libraries before each request is sent to the KDC.
+ * Returning an error aborts that request with that error, which is reported
+ * as "Connection timed out", and returning a reply uses it instead of
+ * sending the request.
+ */
+static krb5_error_code
+send_hook(krb5_context ctx UNUSED, void *data UNUSED,
+          const krb5_data *realm UNUSED, const krb5_data *message UNUSED,
+          krb5_data **new_message UNUSED, krb5_data **new_reply UNUSED)
+{
+# ifdef HAVE_KDC_HEDGE
+    struct realm *info;
+# endif
+
+    if (deadline != 0 && time(NULL) >= deadline)
+        return ETIMEDOUT;
+# ifdef HAVE_KDC_HEDGE
+    if (hedge > 0) {
+        info = realm_load(ctx, realm);
+        if (info->nkdcs > 0)
+            return hedged_send(ctx, info, message, new_reply);
+    }
+# endif
+    return 0;
+}
+
+#endif /* HAVE_KRB5_SET_KDC_SEND_HOOK */
+
+
+/*
+ * Install our hooks into the Kerberos context.  Hedging requests with -e
+ * needs both the send hook and the profile library to find the KDCs.
+ */
+void
+kdc_init(krb5_context ctx UNUSED, struct config *config)
+{
+#ifdef HAVE_KDC_HEDGE
+    profile_t profile;
+    int limit;
+
+    hedge = config->hedge;
+    verbose = config->verbose;
+    if (hedge > 0 && config->statefile != NULL)
+        stats_read(config->statefile);
+    if (hedge > 0 && krb5_get_profile(ctx, &profile) == 0) {
+        if (profile_get_integer(profile, "libdefaults", "udp_preference_limit",
+                                NULL, UDP_LIMIT, &limit) == 0 && limit >= 0)
+            udp_limit = (limit > UDP_LIMIT_MAX) ? UDP_LIMIT_MAX : limit;
+        profile_release(profile);
+    }
+#else
+    if (config->hedge > 0)
+        warn("-e is not supported by these Kerberos libraries, ignoring");
+#endif
+#ifdef HAVE_KRB5_SET_KDC_SEND_HOOK
+    krb5_set_kdc_send_hook(ctx, send_hook, NULL);
+#endif
+}
+
+
+/*
+ * Write the health of each KDC we know about to the state file as a kdc line
+ * giving the realm, the KDC, its average reply time in milliseconds, its
+ * average failure rate in tenths of a percent, and its total replies and
+ * failures.
+ */
+void
+kdc_stats_write(FILE *file UNUSED)
+{
+#ifdef HAVE_KDC_HEDGE
+    size_t i;
+
+    for (i = 0; i < nstats; i++)
+        fprintf(file, "kdc %s %s %lu %lu %lu %lu\n", stats[i].realm,
+                stats[i].host, stats[i].rtt, stats[i].fail_rate,
+                stats[i].replies, stats[i].failures);
+#endif
+}
+
+
+/*
+ * Set the time after which no more requests are sent to the KDC, or clear it
+ * if the time is 0.
+ */
+void
+kdc_deadline(time_t when)
+{
+    deadline = when;
+}
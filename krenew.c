@@ -19,7 +19,6 @@
 #include <portable/system.h>
 
 #include <signal.h>
-#include <sys/stat.h>
 #include <syslog.h>
 #include <time.h>
 
@@ -37,22 +36,48 @@ struct krenew_private {
 /* The usage message. */
 const char usage_message[] = "\
 Usage: krenew [options] [command]\n\
+   -A <command>         Also run <command> with /bin/sh -c (may be repeated)\n\
    -a                   Renew on each wakeup when running as a daemon\n\
    -b                   Fork and run in the background\n\
+   -C <path>            Accept requests on a control socket at <path>\n\
    -c <file>            Write child process ID (PID) to <file>\n\
+   -D <policy>          Flush ticket cache writes to disk: none (default),\n\
+                        data, or full (data and directory)\n\
+   -d <seconds>         Kill aklog and everything it started if it runs for\n\
+                        longer than <seconds>\n\
+   -E <action>          If another process holds the PID file from -p,\n\
+                        refuse to run or replace that process\n\
+   -e <percentile>      Also send KDC requests to the next KDC if no reply\n\
+                        arrives within this percentile of recent replies\n\
+   -G <file>            Increment a generation counter in <file> on each\n\
+                        ticket cache refresh\n\
    -H <limit>           Check for a happy ticket, one that doesn't expire in\n\
                         less than <limit> minutes, and exit 0 if it's okay,\n\
                         otherwise renew the ticket\n\
    -h                   Display this usage message and exit\n\
    -i                   Keep running even if the ticket cache goes away or\n\
                         the ticket can no longer be renewed\n\
+   -j <file>            Save scheduler state in <file> and, on startup, don't\n\
+                        renew if the ticket cache is still good\n\
    -K <interval>        Run as daemon, check ticket every <interval> minutes\n\
    -k <cache>           Use <cache> as the ticket cache\n\
    -L                   Log messages via syslog as well as stderr\n\
+   -M <type>            Type of private ticket cache for a command: file\n\
+                        (default), tmpfs, or keyring\n\
+   -N <method>          Notify a command after each refresh with a signal\n\
+                        (by name or number) or by writing to a pipe\n\
    -p <file>            Write process ID (PID) to <file>\n\
+   -R <count>           Restart a command that fails, up to <count> times\n\
+                        in a row, keeping its tickets and PAG\n\
    -s                   Send SIGHUP to command when ticket cannot be renewed\n\
+   -T <margin>          Only run aklog when the AFS token expires in less\n\
+                        than <margin> minutes\n\
    -t                   Get AFS token via aklog or AKLOG\n\
    -v                   Verbose\n\
+   -W                   Lock the ticket cache while renewing it so that\n\
+                        other krenew or k5start processes don't also do so\n\
+   -w <policy>          With several commands, exit when any (default) or\n\
+                        all of them have exited\n\
    -x                   Exit immediately on any error\n\
 \n\
 If the environment variable AKLOG (or KINIT_PROG for backward compatibility)\n\
@@ -86,40 +111,65 @@ usage(int status)
 
 
 /*
- * Given the Kerberos context and a pointer to the ticket cache, copy that
- * ticket cache to a new cache and return a newly allocated string for the
- * name of the cache.
+ * Copy all the credentials in one ticket cache to another, which is
+ * initialized with the given principal first.  Dies on any error.
+ */
+static void
+copy_creds(krb5_context ctx, krb5_ccache old, krb5_ccache new,
+           krb5_principal princ)
+{
+    krb5_error_code code;
+
+    code = krb5_cc_initialize(ctx, new, princ);
+    if (code != 0)
+        die_krb5(ctx, code, "error initializing new cache");
+    code = krb5_cc_copy_cache(ctx, old, new);
+    if (code != 0)
+        die_krb5(ctx, code, "error copying credentials");
+}
+
+
+/*
+ * Given the Kerberos context, a pointer to the ticket cache, and the type of
+ * private cache to create, copy that ticket cache to a new cache and return a
+ * newly allocated string for the name of the cache.  With a keyring cache,
+ * the copy is done entirely in memory.  Creating a keyring cache joins a new
+ * session keyring, after which a ticket cache in the old session keyring
+ * can't be reached, so in that case the credentials are first copied to a
+ * memory cache.
  */
 static char *
-copy_cache(krb5_context ctx, krb5_ccache *ccache)
+copy_cache(krb5_context ctx, krb5_ccache *ccache, enum private_cache type)
 {
     krb5_error_code code;
     krb5_ccache old, new;
     krb5_principal princ = NULL;
     char *name;
-    int fd;
-
-    xasprintf(&name, "/tmp/krb5cc_%d_XXXXXX", (int) getuid());
-    fd = mkstemp(name);
-    if (fd < 0)
-        sysdie("cannot create ticket cache file");
-    if (fchmod(fd, 0600) < 0)
-        sysdie("cannot chmod ticket cache file");
-    code = krb5_cc_resolve(ctx, name, &new);
-    if (code != 0)
-        die_krb5(ctx, code, "error initializing new ticket cache");
+
     old = *ccache;
     code = krb5_cc_get_principal(ctx, old, &princ);
     if (code != 0)
         die_krb5(ctx, code, "error getting principal from old cache");
-    code = krb5_cc_initialize(ctx, new, princ);
+    if (type == PRIVATE_KEYRING) {
+        code = krb5_cc_resolve(ctx, "MEMORY:krenew", &new);
+        if (code != 0)
+            die_krb5(ctx, code, "error initializing memory ticket cache");
+        copy_creds(ctx, old, new, princ);
+        code = krb5_cc_close(ctx, old);
+        if (code != 0)
+            die_krb5(ctx, code, "error closing old ticket cache");
+        old = new;
+    }
+    name = private_cache_create(type);
+    code = krb5_cc_resolve(ctx, name, &new);
     if (code != 0)
-        die_krb5(ctx, code, "error initializing new cache");
+        die_krb5(ctx, code, "error initializing new ticket cache");
+    copy_creds(ctx, old, new, princ);
     krb5_free_principal(ctx, princ);
-    code = krb5_cc_copy_cache(ctx, old, new);
-    if (code != 0)
-        die_krb5(ctx, code, "error copying credentials");
-    code = krb5_cc_close(ctx, old);
+    if (type == PRIVATE_KEYRING)
+        code = krb5_cc_destroy(ctx, old);
+    else
+        code = krb5_cc_close(ctx, old);
     if (code != 0)
         die_krb5(ctx, code, "error closing old ticket cache");
     *ccache = new;
@@ -148,6 +198,7 @@ renew(krb5_context ctx, struct config *config, krb5_error_code status)
     krb5_principal user = NULL;
     krb5_creds creds;
     bool creds_valid = false;
+    struct timeval start;
 
     /*
      * If we can't read the cache, or if we can't renew tickets for long
@@ -209,6 +260,7 @@ renew(krb5_context ctx, struct config *config, krb5_error_code status)
      * to just store the renewed credentials without creating a cache that
      * grows forever.
      */
+    gettimeofday(&start, NULL);
     code = krb5_cc_initialize(ctx, ccache, user);
     if (code != 0) {
         warn_krb5(ctx, code, "error reinitializing cache");
@@ -219,6 +271,9 @@ renew(krb5_context ctx, struct config *config, krb5_error_code status)
         warn_krb5(ctx, code, "error storing credentials");
         goto done;
     }
+    sync_cache_file(config, config->cache);
+    sync_cache_dir(config, config->cache);
+    report_cache_write(config, &start);
 
 done:
     if (ccache != NULL)
@@ -232,16 +287,20 @@ done:
 
 
 /*
- * The cleanup callback.  All that we do here is send SIGHUP to the child
- * process if it's still running (config->child isn't 0) and we were
- * configured to do so.
+ * The cleanup callback.  All that we do here is send SIGHUP to each command
+ * that's still running (its PID isn't 0) if we were configured to do so.
  */
 static void
 cleanup(krb5_context ctx UNUSED, struct config *config,
         krb5_error_code status UNUSED)
 {
-    if (config->child != 0 && config->private.krenew->signal_child)
-        kill(config->child, SIGHUP);
+    size_t i;
+
+    if (!config->private.krenew->signal_child)
+        return;
+    for (i = 0; i < config->ncommands; i++)
+        if (config->commands[i].pid > 0)
+            kill(config->commands[i].pid, SIGHUP);
 }
 
 
@@ -255,6 +314,9 @@ main(int argc, char *argv[])
     struct krenew_private private;
     krb5_ccache ccache;
     bool run_as_daemon;
+    bool wait_given = false;
+    static const char optstring[]
+        = "A:abC:c:D:d:E:e:G:H:hij:K:k:LM:N:p:qR:sT:tvWw:x";
 
     /* Initialize logging. */
     message_program_name = "krenew";
@@ -263,22 +325,38 @@ main(int argc, char *argv[])
     memset(&config, 0, sizeof(config));
     memset(&private, 0, sizeof(private));
     config.private.krenew = &private;
+    config.argv = argv;
     config.auth = renew;
     config.cleanup = cleanup;
-    while ((option = getopt(argc, argv, "abc:H:hiK:k:Lp:qstvx")) != EOF)
+    while ((option = getopt(argc, argv, optstring)) != EOF)
         switch (option) {
         case 'a': config.always_renew = true;   break;
         case 'b': config.background = true;     break;
+        case 'C': config.control = optarg;      break;
         case 'c': config.childfile = optarg;    break;
         case 'h': usage(0);                     break;
         case 'i': config.ignore_errors = true;  break;
+        case 'G': config.genfile = optarg;      break;
+        case 'j': config.statefile = optarg;    break;
         case 'k': config.cache = optarg;        break;
         case 'p': config.pidfile = optarg;      break;
         case 's': private.signal_child = true;  break;
         case 't': config.do_aklog = true;       break;
         case 'v': config.verbose = true;        break;
+        case 'W': config.lock_cache = true;     break;
         case 'x': config.exit_errors = true;    break;
 
+        case 'A':
+            add_shell_command(&config, optarg);
+            break;
+        case 'D':
+            if (!convert_sync_policy(optarg, &config.sync))
+                die("-D policy argument %s invalid", optarg);
+            break;
+        case 'E':
+            if (!convert_pidfile_action(optarg, &config.pidfile_action))
+                die("-E action argument %s invalid", optarg);
+            break;
         case 'H':
             config.happy_ticket = convert_number(optarg, 10);
             if (config.happy_ticket <= 0)
@@ -298,6 +376,39 @@ main(int argc, char *argv[])
             message_handlers_die(2, message_log_stderr,
                                  message_log_syslog_err);
             break;
+        case 'M':
+            if (!convert_private_cache(optarg, &config.private_cache))
+                die("-M cache type argument %s invalid", optarg);
+            break;
+        case 'N':
+            if (!convert_notify(optarg, &config.notify, &config.notify_signal))
+                die("-N notification argument %s invalid", optarg);
+            break;
+        case 'R':
+            config.restart = convert_number(optarg, 10);
+            if (config.restart <= 0)
+                die("-R restart count argument %s invalid", optarg);
+            break;
+        case 'd':
+            config.aklog_timeout = convert_number(optarg, 10);
+            if (config.aklog_timeout <= 0)
+                die("-d timeout argument %s invalid", optarg);
+            break;
+        case 'e':
+            config.hedge = convert_number(optarg, 10);
+            if (config.hedge <= 0 || config.hedge >= 100)
+                die("-e percentile argument %s invalid", optarg);
+            break;
+        case 'T':
+            config.token_margin = convert_number(optarg, 10);
+            if (config.token_margin <= 0)
+                die("-T margin argument %s invalid", optarg);
+            break;
+        case 'w':
+            if (!convert_wait_policy(optarg, &config.wait))
+                die("-w policy argument %s invalid", optarg);
+            wait_given = true;
+            break;
 
         default:
             usage(1);
@@ -308,7 +419,7 @@ main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
     if (argc > 0)
-        config.command = argv;
+        add_command(&config, argv, true);
 
     /* Check the arguments for consistency. */
     run_as_daemon = (config.keep_ticket != 0 || config.command != NULL);
@@ -316,12 +427,28 @@ main(int argc, char *argv[])
         die("-a only makes sense with -K or a command to run");
     if (config.background && !run_as_daemon)
         die("-b only makes sense with -K or a command to run");
+    if (config.control != NULL && !run_as_daemon)
+        die("-C only makes sense with -K or a command to run");
     if (config.happy_ticket > 0 && config.command != NULL)
         die("-H option cannot be used with a command");
     if (config.childfile != NULL && config.command == NULL)
         die("-c option only makes sense with a command to run");
+    if (config.pidfile_action != PIDFILE_OVERWRITE && config.pidfile == NULL)
+        die("-E option requires a PID file with -p");
     if (private.signal_child && config.command == NULL)
         die("-s option only makes sense with a command to run");
+    if (config.private_cache != PRIVATE_FILE && config.command == NULL)
+        die("-M option only makes sense with a command to run");
+    if (config.notify != NOTIFY_NONE && config.command == NULL)
+        die("-N option only makes sense with a command to run");
+    if (config.restart > 0 && config.command == NULL)
+        die("-R option only makes sense with a command to run");
+    if (wait_given && config.command == NULL)
+        die("-w option only makes sense with a command to run");
+    if (config.token_margin > 0 && !config.do_aklog)
+        die("-T option only makes sense with -t");
+    if (config.aklog_timeout > 0 && !config.do_aklog)
+        die("-d option only makes sense with -t");
 
     /* Establish a Kerberos context and set the ticket cache. */
     code = krb5_init_context(&ctx);
@@ -334,7 +461,9 @@ main(int argc, char *argv[])
     if (code != 0)
         die_krb5(ctx, code, "error opening default ticket cache");
     if (config.command != NULL) {
-        config.cache = copy_cache(ctx, &ccache);
+        config.cache = upgrade_cache();
+        if (config.cache == NULL)
+            config.cache = copy_cache(ctx, &ccache, config.private_cache);
         config.clean_cache = true;
     }
     if (config.cache == NULL) {
@@ -44,18 +44,23 @@ k_haspag(void)
     gid_t *groups;
     uint32_t pag, g0, g1, hi, lo;
 
-    /* First, try the system call if k_pioctl is available. */
+    /*
+     * First, try the system call if k_pioctl is available and the cache
+     * manager isn't already known not to support it.
+     */
 #ifdef HAVE_K_PIOCTL
     int result;
     struct ViceIoctl iob;
 
-    iob.in = NULL;
-    iob.in_size = 0;
-    iob.out = (void *) &pag;
-    iob.out_size = sizeof(pag);
-    result = k_pioctl(NULL, _IOW('C', 13, struct ViceIoctl), &iob, 0);
-    if (result == 0)
-        return pag != (uint32_t) -1;
+    if (k_capabilities() & KAFS_CAP_GETPAG) {
+        iob.in = NULL;
+        iob.in_size = 0;
+        iob.out = (void *) &pag;
+        iob.out_size = sizeof(pag);
+        result = k_pioctl(NULL, _IOW('C', 13, struct ViceIoctl), &iob, 0);
+        if (result == 0)
+            return pag != (uint32_t) -1;
+    }
 #endif
 
     /*
@@ -52,12 +52,23 @@
 # include <sys/ioccom.h>
 #endif
 #include <sys/ioctl.h>
+#include <time.h>
 
 BEGIN_DECLS
 
 /* Assume we have some AFS support available and #undef below if not. */
 #define HAVE_KAFS 1
 
+/*
+ * Flags returned by k_capabilities.  Only our local kafs replacement actually
+ * probes for them; otherwise, everything is assumed to work if AFS does.
+ */
+#define KAFS_CAP_AFS    0x01    /* AFS is available. */
+#define KAFS_CAP_SETPAG 0x02    /* New PAGs can be created. */
+#define KAFS_CAP_GETPAG 0x04    /* The get PAG pioctl is supported. */
+#define KAFS_CAP_TOKENS 0x08    /* The get token pioctl is supported. */
+#define KAFS_CAP_ALL    0x0f
+
 /* We have a libkafs or libkopenafs library. */
 #if HAVE_K_HASAFS
 # if HAVE_KAFS_H
@@ -75,6 +86,8 @@ int k_pioctl(char *, struct ViceIoctl *, void *, int);
 int k_setpag(void);
 int k_unlog(void);
 # endif
+# define k_capabilities()     (k_hasafs() ? KAFS_CAP_ALL : 0)
+# define k_tokenexpiry(e)     (errno = ENOSYS, -1)
 # ifdef HAVE_K_HASPAG
 #  if !defined(HAVE_KAFS_H) && !defined(HAVE_KOPENAFS_H)
 int k_haspag(void);
@@ -91,10 +104,12 @@ int k_haspag(void) __attribute__((__visibility__("hidden")));
 int lsetpag(void);
 int lpioctl(char *, int, void *, int);
 # endif
+# define k_capabilities()     (KAFS_CAP_ALL)
 # define k_hasafs()           (1)
 # define k_pioctl(p, c, a, f) lpioctl((p), (c), (a), (f))
 # define k_setpag()           lsetpag()
 # define k_unlog()            (errno = ENOSYS, -1)
+# define k_tokenexpiry(e)     (errno = ENOSYS, -1)
 
 int k_haspag(void) __attribute__((__visibility__("hidden")));
 
@@ -111,10 +126,12 @@ struct ViceIoctl {
 /* Default to a hidden visibility for all portability functions. */
 #pragma GCC visibility push(hidden)
 
+int k_capabilities(void);
 int k_hasafs(void);
 int k_haspag(void);
 int k_pioctl(char *, int, struct ViceIoctl *, int);
 int k_setpag(void);
+int k_tokenexpiry(time_t *);
 int k_unlog(void);
 
 /* Undo default visibility change. */
@@ -123,11 +140,13 @@ int k_unlog(void);
 /* We have no kafs implementation available. */
 #else
 # undef HAVE_KAFS
+# define k_capabilities()     (0)
 # define k_hasafs()           (0)
 # define k_haspag()           (0)
 # define k_pioctl(p, c, a, f) (errno = ENOSYS, -1)
 # define k_setpag()           (errno = ENOSYS, -1)
 # define k_unlog()            (errno = ENOSYS, -1)
+# define k_tokenexpiry(e)     (errno = ENOSYS, -1)
 #endif
 
 END_DECLS
@@ -0,0 +1,561 @@
+/*
+ * Native AFS tokens for the Linux in-kernel AFS client.
+ *
+ * The Linux kernel has its own AFS client (kAFS), which doesn't use the
+ * OpenAFS system call interface.  It instead finds credentials in keys of
+ * type rxrpc named afs@<cell> in the process keyrings, and a new session
+ * keyring serves as the equivalent of a PAG.  That means k5start and krenew
+ * can give the kernel a token directly with a single add_key system call
+ * after each refresh instead of running aklog.
+ *
+ * The key payload is the rxkad form of a token: the AFS service ticket and
+ * a DES session key.  Since Kerberos no longer issues DES session keys, the
+ * DES key is derived from the real session key as done by OpenAFS and the
+ * kAFS aklog, which requires HMAC-MD5.  A small MD5 implementation is
+ * included here for that rather than adding a dependency on a crypto
+ * library.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_KEYCTL_H
+# include <linux/keyctl.h>
+# include <sys/syscall.h>
+#endif
+
+#include <internal.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/messages-krb5.h>
+#include <util/xmalloc.h>
+
+/* Whether we can add keys to the kernel keyrings on this system. */
+#if defined(HAVE_LINUX_KEYCTL_H) && defined(SYS_keyctl) \
+    && defined(SYS_add_key)
+# define HAVE_RXRPC 1
+#endif
+
+#ifdef HAVE_RXRPC
+
+/* Files that exist if the kernel AFS client is loaded and name the cell. */
+static const char * const rootcell_paths[] = {
+    "/proc/net/afs/rootcell",
+    "/proc/fs/afs/rootcell",
+    NULL
+};
+
+/*
+ * Constants for the rxrpc key payload.  The version of the key payload
+ * interface, the rxkad security index, the ticket type that says that the
+ * ticket is a Kerberos v5 ticket, and the longest ticket the kernel accepts.
+ */
+#define RXRPC_KEY_VERSION    1
+#define RXRPC_SECURITY_RXKAD 2
+#define RXKAD_TKT_TYPE_KRB5  256
+#define RXRPC_TICKET_MAX     12000
+
+/* Kerberos encryption types that need special handling (RFC 3961). */
+#define KRB5_DES_CBC_CRC     1
+#define KRB5_DES_CBC_MD4     2
+#define KRB5_DES_CBC_MD5     3
+#define KRB5_DES3_CBC_SHA1   16
+
+/* MIT and Heimdal store the session key in krb5_creds differently. */
+#ifdef HAVE_KRB5_CREDS_SESSION
+# define CREDS_ENCTYPE(c) ((c)->session.keytype)
+# define CREDS_KEY(c)     ((c)->session.keyvalue.data)
+# define CREDS_KEYLEN(c)  ((c)->session.keyvalue.length)
+#else
+# define CREDS_ENCTYPE(c) ((c)->keyblock.enctype)
+# define CREDS_KEY(c)     ((c)->keyblock.contents)
+# define CREDS_KEYLEN(c)  ((c)->keyblock.length)
+#endif
+
+/* Per-round additive constants and rotations for MD5 (RFC 1321). */
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static const unsigned int md5_r[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+/* DES weak and semi-weak keys, which the derived key must not be. */
+static const unsigned char des_weak_keys[16][8] = {
+    { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 },
+    { 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe },
+    { 0x1f, 0x1f, 0x1f, 0x1f, 0x0e, 0x0e, 0x0e, 0x0e },
+    { 0xe0, 0xe0, 0xe0, 0xe0, 0xf1, 0xf1, 0xf1, 0xf1 },
+    { 0x01, 0xfe, 0x01, 0xfe, 0x01, 0xfe, 0x01, 0xfe },
+    { 0xfe, 0x01, 0xfe, 0x01, 0xfe, 0x01, 0xfe, 0x01 },
+    { 0x1f, 0xe0, 0x1f, 0xe0, 0x0e, 0xf1, 0x0e, 0xf1 },
+    { 0xe0, 0x1f, 0xe0, 0x1f, 0xf1, 0x0e, 0xf1, 0x0e },
+    { 0x01, 0xe0, 0x01, 0xe0, 0x01, 0xf1, 0x01, 0xf1 },
+    { 0xe0, 0x01, 0xe0, 0x01, 0xf1, 0x01, 0xf1, 0x01 },
+    { 0x1f, 0xfe, 0x1f, 0xfe, 0x0e, 0xfe, 0x0e, 0xfe },
+    { 0xfe, 0x1f, 0xfe, 0x1f, 0xfe, 0x0e, 0xfe, 0x0e },
+    { 0x01, 0x1f, 0x01, 0x1f, 0x01, 0x0e, 0x01, 0x0e },
+    { 0x1f, 0x01, 0x1f, 0x01, 0x0e, 0x01, 0x0e, 0x01 },
+    { 0xe0, 0xfe, 0xe0, 0xfe, 0xf1, 0xfe, 0xf1, 0xfe },
+    { 0xfe, 0xe0, 0xfe, 0xe0, 0xfe, 0xf1, 0xfe, 0xf1 },
+};
+
+
+/*
+ * Process one 64-byte block of MD5 input, updating the state.
+ */
+static void
+md5_block(uint32_t state[4], const unsigned char *block)
+{
+    uint32_t m[16], a, b, c, d, f, tmp;
+    unsigned int i, g, r;
+
+    for (i = 0; i < 16; i++)
+        m[i] = (uint32_t) block[i * 4]
+            | ((uint32_t) block[i * 4 + 1] << 8)
+            | ((uint32_t) block[i * 4 + 2] << 16)
+            | ((uint32_t) block[i * 4 + 3] << 24);
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    for (i = 0; i < 64; i++) {
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        r = md5_r[(i / 16) * 4 + i % 4];
+        tmp = d;
+        d = c;
+        c = b;
+        f += a + md5_k[i] + m[g];
+        b += (f << r) | (f >> (32 - r));
+        a = tmp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+
+/*
+ * Compute the MD5 hash of the given data, storing the 16-byte result in out.
+ * Only short inputs are hashed here, so the padded message is built in
+ * memory and processed all at once.
+ */
+static void
+md5(const unsigned char *data, size_t length, unsigned char out[16])
+{
+    uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned char *message;
+    uint64_t bits;
+    size_t size, i;
+
+    size = ((length + 8) / 64 + 1) * 64;
+    message = xcalloc(size, 1);
+    memcpy(message, data, length);
+    message[length] = 0x80;
+    bits = (uint64_t) length * 8;
+    for (i = 0; i < 8; i++)
+        message[size - 8 + i] = (bits >> (i * 8)) & 0xff;
+    for (i = 0; i < size; i += 64)
+        md5_block(state, message + i);
+    free(message);
+    for (i = 0; i < 16; i++)
+        out[i] = (state[i / 4] >> ((i % 4) * 8)) & 0xff;
+}
+
+
+/*
+ * Compute HMAC-MD5 (RFC 2104) of the given data with the given key, storing
+ * the 16-byte result in out.
+ */
+static void
+hmac_md5(const unsigned char *key, size_t keylen, const unsigned char *data,
+         size_t length, unsigned char out[16])
+{
+    unsigned char pad[64], hash[16];
+    unsigned char *buffer;
+    size_t i;
+
+    if (keylen > sizeof(pad)) {
+        md5(key, keylen, hash);
+        key = hash;
+        keylen = sizeof(hash);
+    }
+    buffer = xmalloc(sizeof(pad) + (length > 16 ? length : 16));
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, keylen);
+    for (i = 0; i < sizeof(pad); i++)
+        buffer[i] = pad[i] ^ 0x36;
+    memcpy(buffer + sizeof(pad), data, length);
+    md5(buffer, sizeof(pad) + length, out);
+    for (i = 0; i < sizeof(pad); i++)
+        buffer[i] = pad[i] ^ 0x5c;
+    memcpy(buffer + sizeof(pad), out, 16);
+    md5(buffer, sizeof(pad) + 16, out);
+    free(buffer);
+}
+
+
+/*
+ * Set each byte of a DES key to odd parity.
+ */
+static void
+des_set_parity(unsigned char key[8])
+{
+    unsigned int i, bit, bits;
+
+    for (i = 0; i < 8; i++) {
+        bits = 0;
+        for (bit = 1; bit < 8; bit++)
+            bits += (key[i] >> bit) & 1;
+        key[i] = (key[i] & 0xfe) | ((bits % 2 == 0) ? 1 : 0);
+    }
+}
+
+
+/*
+ * Derive the DES session key for rxkad from the Kerberos session key in the
+ * given credentials, storing it in key.  DES keys are used as is.  Any other
+ * key goes through the rxkad key derivation function, which takes the first
+ * eight bytes of an HMAC-MD5 of a counter and a fixed label and retries with
+ * the next counter if the result is a weak key.  Triple DES keys have their
+ * parity bits removed first.  Returns false if no key could be derived.
+ */
+static bool
+derive_key(krb5_creds *creds, unsigned char key[8])
+{
+    static const unsigned char label[] = "rxkad";
+    unsigned char input[1 + sizeof(label) + 4], hash[16];
+    unsigned char *session;
+    size_t length, i, j;
+    unsigned int counter;
+    bool weak;
+
+    length = CREDS_KEYLEN(creds);
+    switch (CREDS_ENCTYPE(creds)) {
+    case KRB5_DES_CBC_CRC:
+    case KRB5_DES_CBC_MD4:
+    case KRB5_DES_CBC_MD5:
+        if (length != 8)
+            return false;
+        memcpy(key, CREDS_KEY(creds), 8);
+        return true;
+    default:
+        break;
+    }
+    session = xmalloc(length);
+    memcpy(session, CREDS_KEY(creds), length);
+    if (CREDS_ENCTYPE(creds) == KRB5_DES3_CBC_SHA1) {
+        if (length % 8 != 0) {
+            free(session);
+            return false;
+        }
+        for (i = 0; i < length / 8; i++) {
+            for (j = 0; j < 7; j++)
+                session[i * 8 + j] = (session[i * 8 + j] & 0xfe)
+                    | ((session[i * 8 + 7] >> (j + 1)) & 1);
+            memmove(session + i * 7, session + i * 8, 7);
+        }
+        length = length / 8 * 7;
+    }
+
+    /* The counter, the label including its nul, and the output bit count. */
+    memcpy(input + 1, label, sizeof(label));
+    memcpy(input + 1 + sizeof(label), "\0\0\0\100", 4);
+    for (counter = 1; counter < 255; counter++) {
+        input[0] = counter;
+        hmac_md5(session, length, input, sizeof(input), hash);
+        des_set_parity(hash);
+        weak = false;
+        for (i = 0; i < ARRAY_SIZE(des_weak_keys); i++)
+            if (memcmp(hash, des_weak_keys[i], 8) == 0)
+                weak = true;
+        if (!weak) {
+            memcpy(key, hash, 8);
+            free(session);
+            return true;
+        }
+    }
+    free(session);
+    return false;
+}
+
+
+/*
+ * Read the name of the local cell from the kernel AFS client.  Returns a
+ * newly allocated string or NULL if the kernel client isn't loaded or
+ * doesn't have a cell configured.
+ */
+static char *
+rootcell(void)
+{
+    FILE *file;
+    char buffer[BUFSIZ];
+    size_t i;
+    char *end;
+
+    for (i = 0; rootcell_paths[i] != NULL; i++) {
+        file = fopen(rootcell_paths[i], "r");
+        if (file == NULL)
+            continue;
+        if (fgets(buffer, sizeof(buffer), file) == NULL) {
+            fclose(file);
+            continue;
+        }
+        fclose(file);
+        end = strchr(buffer, '\n');
+        if (end != NULL)
+            *end = '\0';
+        if (buffer[0] != '\0')
+            return xstrdup(buffer);
+    }
+    return NULL;
+}
+
+
+/*
+ * Get the AFS service ticket for the given cell from the ticket cache,
+ * trying afs/<cell>@<CELL> and then the older afs@<CELL> form as aklog
+ * does.  Returns a Kerberos status code and stores the credentials in creds
+ * on success.
+ */
+static krb5_error_code
+get_afs_creds(krb5_context ctx, const char *cache, const char *cell,
+              krb5_creds **creds)
+{
+    krb5_creds in;
+    krb5_ccache ccache = NULL;
+    krb5_principal client = NULL;
+    krb5_error_code code;
+    char *realm, *p;
+    char *names[2] = { NULL, NULL };
+    size_t i;
+
+    *creds = NULL;
+    realm = xstrdup(cell);
+    for (p = realm; *p != '\0'; p++)
+        *p = toupper((unsigned char) *p);
+    code = krb5_cc_resolve(ctx, cache, &ccache);
+    if (code != 0)
+        goto done;
+    code = krb5_cc_get_principal(ctx, ccache, &client);
+    if (code != 0)
+        goto done;
+    xasprintf(&names[0], "afs/%s@%s", cell, realm);
+    xasprintf(&names[1], "afs@%s", realm);
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        memset(&in, 0, sizeof(in));
+        in.client = client;
+        code = krb5_parse_name(ctx, names[i], &in.server);
+        if (code != 0)
+            break;
+        code = krb5_get_credentials(ctx, 0, ccache, &in, creds);
+        krb5_free_principal(ctx, in.server);
+        if (code == 0)
+            break;
+    }
+
+done:
+    if (client != NULL)
+        krb5_free_principal(ctx, client);
+    if (ccache != NULL)
+        krb5_cc_close(ctx, ccache);
+    free(names[0]);
+    free(names[1]);
+    free(realm);
+    return code;
+}
+
+#endif /* HAVE_RXRPC */
+
+
+/*
+ * Returns true if the kernel AFS client is loaded and we're able to give it
+ * tokens directly.
+ */
+bool
+rxrpc_available(void)
+{
+#ifdef HAVE_RXRPC
+    size_t i;
+
+    for (i = 0; rootcell_paths[i] != NULL; i++)
+        if (access(rootcell_paths[i], R_OK) == 0)
+            return true;
+#endif
+    return false;
+}
+
+
+/*
+ * Create the kernel AFS client's equivalent of a PAG by joining a new,
+ * anonymous session keyring, which is inherited by the command.  Returns 0
+ * on success and -1 with errno set on failure.
+ */
+int
+rxrpc_setpag(void)
+{
+#ifdef HAVE_RXRPC
+    if (syscall(SYS_keyctl, KEYCTL_JOIN_SESSION_KEYRING, NULL) < 0)
+        return -1;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+/*
+ * Give the kernel AFS client a token for the local cell by adding an rxrpc
+ * key made from the AFS service ticket to the session keyring, replacing
+ * any previous key for that cell.  This takes the place of running aklog.
+ *
+ * The same key is also added to each of the other keyrings given, which are
+ * the PAGs of other processes registered on the control socket.  Keyrings
+ * that no longer exist or that we aren't allowed to write to are removed
+ * from the array and the count updated.
+ * Problems are reported, and false is returned if the token couldn't be
+ * made or added to our own session keyring.  The arguments are unused on
+ * systems without kernel keyrings.
+ */
+bool
+rxrpc_token(krb5_context ctx UNUSED, struct config *config UNUSED,
+            long *keyrings UNUSED, size_t *nkeyrings UNUSED)
+{
+#ifdef HAVE_RXRPC
+    krb5_creds *creds = NULL;
+    krb5_error_code code;
+    unsigned char key[8];
+    unsigned char *payload = NULL;
+    char *cell, *desc = NULL;
+    uint32_t version, expiry, kvno;
+    uint16_t index, length;
+    size_t size, offset, i;
+    bool okay = false;
+
+    cell = rootcell();
+    if (cell == NULL) {
+        warn("cannot determine the local AFS cell");
+        return false;
+    }
+    code = get_afs_creds(ctx, config->cache, cell, &creds);
+    if (code != 0) {
+        warn_krb5(ctx, code, "cannot get AFS service ticket for %s", cell);
+        goto done;
+    }
+    if (creds->ticket.length > RXRPC_TICKET_MAX) {
+        warn("AFS service ticket for %s too long", cell);
+        goto done;
+    }
+    if (!derive_key(creds, key)) {
+        warn("cannot derive rxkad session key for %s", cell);
+        goto done;
+    }
+
+    /* Build the version 1 rxkad key payload in host byte order. */
+    version = RXRPC_KEY_VERSION;
+    index = RXRPC_SECURITY_RXKAD;
+    length = creds->ticket.length;
+    expiry = creds->times.endtime;
+    kvno = RXKAD_TKT_TYPE_KRB5;
+    size = sizeof(version) + sizeof(index) + sizeof(length) + sizeof(expiry)
+        + sizeof(kvno) + sizeof(key) + length;
+    payload = xmalloc(size);
+    memcpy(payload, &version, sizeof(version));
+    offset = sizeof(version);
+    memcpy(payload + offset, &index, sizeof(index));
+    offset += sizeof(index);
+    memcpy(payload + offset, &length, sizeof(length));
+    offset += sizeof(length);
+    memcpy(payload + offset, &expiry, sizeof(expiry));
+    offset += sizeof(expiry);
+    memcpy(payload + offset, &kvno, sizeof(kvno));
+    offset += sizeof(kvno);
+    memcpy(payload + offset, key, sizeof(key));
+    offset += sizeof(key);
+    memcpy(payload + offset, creds->ticket.data, length);
+
+    /* Install it, which replaces any existing key with the same name. */
+    xasprintf(&desc, "afs@%s", cell);
+    if (syscall(SYS_add_key, "rxrpc", desc, payload, size,
+                KEY_SPEC_SESSION_KEYRING) < 0) {
+        syswarn("cannot add AFS key %s", desc);
+        goto done;
+    }
+    if (config->verbose)
+        notice("installed AFS token for %s", cell);
+    okay = true;
+
+    /* Add it to the registered keyrings, dropping any that are gone. */
+    i = 0;
+    while (i < *nkeyrings) {
+        if (syscall(SYS_add_key, "rxrpc", desc, payload, size,
+                    keyrings[i]) >= 0) {
+            i++;
+            continue;
+        }
+        if (errno == EACCES)
+            syswarn("cannot add AFS key %s to keyring %ld, no longer"
+                    " maintaining it", desc, keyrings[i]);
+        else if (errno != ENOKEY && errno != EKEYREVOKED
+                 && errno != EKEYEXPIRED) {
+            syswarn("cannot add AFS key %s to keyring %ld", desc, keyrings[i]);
+            i++;
+            continue;
+        } else if (config->verbose)
+            notice("keyring %ld is gone, no longer maintaining it",
+                   keyrings[i]);
+        memmove(keyrings + i, keyrings + i + 1,
+                (*nkeyrings - i - 1) * sizeof(long));
+        (*nkeyrings)--;
+    }
+
+done:
+    if (creds != NULL)
+        krb5_free_creds(ctx, creds);
+    if (payload != NULL) {
+        memset(payload, 0, size);
+        free(payload);
+    }
+    memset(key, 0, sizeof(key));
+    free(desc);
+    free(cell);
+    return okay;
+#else
+    warn("kernel AFS tokens are not supported on this system");
+    return false;
+#endif
+}
@@ -0,0 +1,224 @@
+/*
+ * Persistent scheduler state and generation file for k5start and krenew.
+ *
+ * When given a state file with -j, k5start and krenew record there the
+ * ticket cache and principal they maintain, when the cache was last
+ * refreshed, when its tickets expire, and the result of the last attempt.
+ * On restart, the framework uses this to decide whether the existing ticket
+ * cache can be trusted without authenticating again and when the next
+ * refresh is due.
+ *
+ * The file is a simple list of lines of the form "<key> <value>".  Unknown
+ * keys are ignored so that later versions can add more information.  With
+ * -e, the health of each KDC is also saved there as kdc lines, which are
+ * written and read by the KDC hooks.
+ *
+ * When given a generation file with -G, k5start and krenew map it into
+ * memory and increment the generation counter in it each time they refresh
+ * the ticket cache, so that other programs can tell that the ticket cache
+ * has changed by reading it without polling the cache itself.  Readers have
+ * to load the generation atomically with acquire semantics, since it's
+ * published with a release store after the times of the refresh.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+
+/*
+ * Parse a time or count from the state file.  Returns false if the value
+ * isn't a valid non-negative number.
+ */
+static bool
+parse_number(const char *value, unsigned long *result)
+{
+    char *end;
+
+    errno = 0;
+    *result = strtoul(value, &end, 10);
+    return (errno == 0 && end != value && *end == '\0' && value[0] != '-');
+}
+
+
+/*
+ * Read the state file at the given path into the provided struct, which
+ * should be freed with state_free afterwards.  Returns false if the file
+ * doesn't exist or isn't valid, in which case there is nothing to free.
+ * Problems other than a missing file are reported.
+ */
+bool
+state_read(const char *path, struct state *state)
+{
+    FILE *file;
+    char buffer[BUFSIZ];
+    char *value, *end;
+    unsigned long number;
+    bool okay = true;
+
+    memset(state, 0, sizeof(*state));
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno != ENOENT)
+            syswarn("cannot open state file %s", path);
+        return false;
+    }
+    while (okay && fgets(buffer, sizeof(buffer), file) != NULL) {
+        end = strchr(buffer, '\n');
+        if (end == NULL) {
+            okay = false;
+            break;
+        }
+        *end = '\0';
+        value = strchr(buffer, ' ');
+        if (value == NULL) {
+            okay = false;
+            break;
+        }
+        *value++ = '\0';
+        if (strcmp(buffer, "cache") == 0) {
+            free(state->cache);
+            state->cache = xstrdup(value);
+        } else if (strcmp(buffer, "principal") == 0) {
+            free(state->principal);
+            state->principal = xstrdup(value);
+        } else if (strcmp(buffer, "refreshed") == 0) {
+            okay = parse_number(value, &number);
+            state->refreshed = number;
+        } else if (strcmp(buffer, "expires") == 0) {
+            okay = parse_number(value, &number);
+            state->expires = number;
+        } else if (strcmp(buffer, "failures") == 0) {
+            okay = parse_number(value, &state->failures);
+        } else if (strcmp(buffer, "status") == 0) {
+            state->status = strtol(value, NULL, 10);
+        }
+    }
+    if (ferror(file)) {
+        syswarn("cannot read state file %s", path);
+        okay = false;
+    }
+    fclose(file);
+    if (okay && (state->cache == NULL || state->principal == NULL))
+        okay = false;
+    if (!okay) {
+        warn("ignoring invalid state file %s", path);
+        state_free(state);
+    }
+    return okay;
+}
+
+
+/*
+ * Write the state to the given path.  The new contents are written to a
+ * temporary file next to it and then renamed into place so that a crash
+ * never leaves a partial state file.  Errors are reported but otherwise
+ * ignored, since the state file is only an optimization.
+ */
+void
+state_write(const char *path, const struct state *state)
+{
+    FILE *file;
+    char *tmp;
+    int fd, status;
+
+    xasprintf(&tmp, "%s_XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        syswarn("cannot create temporary state file for %s", path);
+        free(tmp);
+        return;
+    }
+    file = fdopen(fd, "w");
+    if (file == NULL) {
+        syswarn("cannot create temporary state file for %s", path);
+        close(fd);
+        goto fail;
+    }
+    fprintf(file, "cache %s\n", state->cache);
+    fprintf(file, "principal %s\n", state->principal);
+    fprintf(file, "refreshed %lu\n", (unsigned long) state->refreshed);
+    fprintf(file, "expires %lu\n", (unsigned long) state->expires);
+    fprintf(file, "failures %lu\n", state->failures);
+    fprintf(file, "status %ld\n", (long) state->status);
+    kdc_stats_write(file);
+    status = ferror(file);
+    if (fclose(file) == EOF || status != 0) {
+        syswarn("cannot write state file %s", tmp);
+        goto fail;
+    }
+    if (rename(tmp, path) < 0) {
+        syswarn("cannot rename %s to %s", tmp, path);
+        goto fail;
+    }
+    free(tmp);
+    return;
+
+fail:
+    unlink(tmp);
+    free(tmp);
+}
+
+
+/*
+ * Free the contents of a state struct.
+ */
+void
+state_free(struct state *state)
+{
+    free(state->cache);
+    free(state->principal);
+    memset(state, 0, sizeof(*state));
+}
+
+
+/*
+ * Open the generation file, creating it if it doesn't exist, and map it into
+ * memory.  An existing file of the right size is used as is so that the
+ * generation keeps increasing across restarts; anything else is reset to
+ * zero.  Returns NULL after reporting an error on failure.
+ */
+struct generation *
+generation_open(const char *path)
+{
+    struct generation *generation;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        syswarn("cannot open generation file %s", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        syswarn("cannot stat generation file %s", path);
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size != sizeof(struct generation))
+        if (ftruncate(fd, 0) < 0
+            || ftruncate(fd, sizeof(struct generation)) < 0) {
+            syswarn("cannot resize generation file %s", path);
+            close(fd);
+            return NULL;
+        }
+    generation = mmap(NULL, sizeof(struct generation), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (generation == MAP_FAILED) {
+        syswarn("cannot map generation file %s", path);
+        return NULL;
+    }
+    return generation;
+}
@@ -0,0 +1,185 @@
+/*
+ * systemd service notification for k5start and krenew.
+ *
+ * When run by systemd as a Type=notify service, k5start and krenew tell
+ * systemd when they have obtained tickets, report the remaining lifetime of
+ * the ticket as the service status, and ping the service watchdog if one was
+ * configured.  This implements the small part of the sd_notify protocol that
+ * they need directly rather than linking with libsystemd: each notification
+ * is a single datagram sent to the UNIX-domain socket named in NOTIFY_SOCKET,
+ * which may be in the abstract namespace if it starts with @.
+ *
+ * As with sd_notify with unset_environment set, the systemd variables are
+ * removed from the environment once read so that the commands and aklog
+ * don't inherit them and send notifications of their own on our behalf.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Some systems don't have MSG_NOSIGNAL, but this is a datagram socket. */
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/* The systemd environment variables that we read and then remove. */
+enum systemd_variable {
+    NOTIFY_SOCKET,
+    WATCHDOG_USEC,
+    WATCHDOG_PID,
+    NVARIABLES
+};
+static const char *const variables[NVARIABLES] = {
+    "NOTIFY_SOCKET", "WATCHDOG_USEC", "WATCHDOG_PID"
+};
+
+/* Their values when we started, or NULL if they weren't set. */
+static char *values[NVARIABLES];
+
+
+/*
+ * Save the systemd environment variables and remove them from the
+ * environment.  This should be called before running any other program.  It
+ * may be called again after systemd_export, replacing the saved values.
+ */
+void
+systemd_init(void)
+{
+    const char *value;
+    size_t i;
+
+    for (i = 0; i < NVARIABLES; i++) {
+        value = getenv(variables[i]);
+        if (value == NULL)
+            continue;
+        free(values[i]);
+        values[i] = xstrdup(value);
+        unsetenv(variables[i]);
+    }
+}
+
+
+/*
+ * Put the saved systemd environment variables back into the environment, for
+ * when we re-execute ourselves and the new binary takes over notifications.
+ * Returns false after reporting an error on failure.
+ */
+bool
+systemd_export(void)
+{
+    size_t i;
+
+    for (i = 0; i < NVARIABLES; i++) {
+        if (values[i] == NULL)
+            continue;
+        if (setenv(variables[i], values[i], 1) != 0) {
+            syswarn("cannot set %s environment variable", variables[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Returns true if we were started by systemd with a notification socket, in
+ * which case systemd_notify will send notifications.
+ */
+bool
+systemd_enabled(void)
+{
+    const char *path = values[NOTIFY_SOCKET];
+
+    return (path != NULL && (path[0] == '/' || path[0] == '@'));
+}
+
+
+/*
+ * Send a notification to systemd, formatted as with printf.  This does
+ * nothing if we weren't started by systemd.  Failures are reported but
+ * otherwise ignored, since they don't affect the tickets we maintain.
+ */
+void
+systemd_notify(const char *format, ...)
+{
+    struct sockaddr_un addr;
+    const char *path;
+    char *message;
+    va_list args;
+    size_t length;
+    socklen_t size;
+    int fd;
+
+    if (!systemd_enabled())
+        return;
+    path = values[NOTIFY_SOCKET];
+    length = strlen(path);
+    if (length >= sizeof(addr.sun_path)) {
+        warn("NOTIFY_SOCKET path %s too long", path);
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, length);
+    if (addr.sun_path[0] == '@')
+        addr.sun_path[0] = '\0';
+    size = offsetof(struct sockaddr_un, sun_path) + length;
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        syswarn("cannot create socket to notify systemd");
+        return;
+    }
+    va_start(args, format);
+    xvasprintf(&message, format, args);
+    va_end(args);
+    if (sendto(fd, message, strlen(message), MSG_NOSIGNAL,
+               (struct sockaddr *) &addr, size) < 0)
+        syswarn("cannot notify systemd");
+    close(fd);
+    free(message);
+}
+
+
+/*
+ * Returns the interval in seconds at which we should ping the systemd
+ * watchdog, which is half of the watchdog timeout as recommended, or 0 if
+ * the watchdog isn't enabled for this process.
+ */
+time_t
+systemd_watchdog(void)
+{
+    const char *value;
+    unsigned long usec, pid;
+    char *end;
+
+    if (!systemd_enabled())
+        return 0;
+    value = values[WATCHDOG_PID];
+    if (value != NULL) {
+        errno = 0;
+        pid = strtoul(value, &end, 10);
+        if (errno != 0 || *end != '\0' || pid != (unsigned long) getpid())
+            return 0;
+    }
+    value = values[WATCHDOG_USEC];
+    if (value == NULL)
+        return 0;
+    errno = 0;
+    usec = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || usec == 0)
+        return 0;
+    if (usec < 2000000)
+        return 1;
+    return usec / 2000000;
+}
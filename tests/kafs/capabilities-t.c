@@ -0,0 +1,51 @@
+/*
+ * Test suite for k_capabilities.
+ *
+ * We can't tell from here what the AFS cache manager should support, but we
+ * can check that the result is consistent with k_hasafs, that it's cached,
+ * and that a child process after fork gets the same answer.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/system.h>
+
+#include <sys/wait.h>
+
+#include <tests/tap/basic.h>
+
+
+int
+main(void)
+{
+    int caps, status;
+    pid_t child;
+
+    plan(5);
+
+    caps = k_capabilities();
+    is_int(0, caps & ~KAFS_CAP_ALL, "no unknown capabilities");
+    is_int(caps, k_capabilities(), "second call returns the same result");
+    is_int(k_hasafs() != 0, (caps & KAFS_CAP_AFS) != 0,
+           "KAFS_CAP_AFS matches k_hasafs");
+    if (caps & KAFS_CAP_AFS)
+        ok(1, "no capabilities without AFS");
+    else
+        is_int(0, caps, "no capabilities without AFS");
+
+    /* The child probes again and should get the same answer. */
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0)
+        _exit(k_capabilities() == caps ? 0 : 1);
+    if (waitpid(child, &status, 0) != child)
+        sysbail("cannot wait for child");
+    ok(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+       "child process gets the same result");
+
+    return 0;
+}
@@ -1,7 +1,7 @@
 /*
  * Shared command handling for k5start and krenew.
  *
- * Run a command, possibly a long-running one for which we need to wait.
+ * Run commands, possibly long-running ones for which we need to wait.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 1995, 1996, 1997, 1999, 2000, 2001, 2002, 2004, 2005, 2007,
@@ -14,34 +14,106 @@
 #include <config.h>
 #include <portable/system.h>
 
+#include <errno.h>
 #include <signal.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
 #include <sys/wait.h>
 
 #include <util/command.h>
 #include <util/macros.h>
 #include <util/messages.h>
+#include <util/xmalloc.h>
 
-/* Global so that it can be used in signal handlers. */
-static pid_t global_child_pid;
+/*
+ * The running children, kept in a global so that the signal handlers can
+ * reach them.  A slot with a PID of 0 is free.  Each slot also records the
+ * last signal propagated to that child.
+ */
+struct child {
+    volatile pid_t pid;
+    volatile sig_atomic_t signal;
+};
+static struct child *children = NULL;
+static size_t nchildren = 0;
+
+/* The last SIGINT, SIGQUIT, or SIGTERM we received, or 0 if none. */
+static volatile sig_atomic_t global_stop = 0;
 
 
 /*
- * Run the given aklog command, returning its exit status.  The command must
- * be a fully-qualified path.
+ * Run the given aklog command with the shell in a new process group and
+ * return its exit status, or -1 if it couldn't be run, died from a signal,
+ * or was killed.  If timeout isn't 0, the whole process group is killed if
+ * the command hasn't finished after that many seconds, since aklog may hang
+ * talking to an AFS server and everything it started should go with it.
+ * How long the command ran in milliseconds is stored in duration.
+ *
+ * There may be no SIGCHLD handler to interrupt a sleep when the command
+ * exits, so with a timeout we poll for it, starting at 10ms and backing off
+ * to 250ms between checks.
  */
-void
-command_run(const char *aklog, bool verbose)
+int
+command_run(const char *aklog, unsigned int timeout, unsigned long *duration)
 {
-    int status;
-
-    /*
-     * IRIX 6.5's WEXITSTATUS() macro is broken and can't cope with being
-     * called directly on the return value of system().
-     */
-    status = system(aklog);
-    status = WEXITSTATUS(status);
-    if (verbose)
-        notice("%s exited with status %d\n", aklog, status);
+    struct timeval start, now, delay;
+    unsigned long elapsed, interval = 10;
+    pid_t child, result;
+    int status, flags;
+    bool killed = false;
+
+    gettimeofday(&start, NULL);
+    *duration = 0;
+    child = fork();
+    if (child < 0) {
+        syswarn("cannot fork to run %s", aklog);
+        return -1;
+    } else if (child == 0) {
+        setpgid(0, 0);
+        execl("/bin/sh", "sh", "-c", aklog, (char *) 0);
+        _exit(127);
+    }
+
+    /* Also set the process group here so that kill can't race with it. */
+    setpgid(child, child);
+    flags = (timeout == 0) ? 0 : WNOHANG;
+    while (1) {
+        result = waitpid(child, &status, flags);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result != 0)
+            break;
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000
+            + (now.tv_usec - start.tv_usec) / 1000;
+        if (elapsed >= timeout * 1000UL) {
+            warn("%s still running after %u seconds, killing it", aklog,
+                 timeout);
+            kill(-child, SIGKILL);
+            killed = true;
+            flags = 0;
+            continue;
+        }
+        delay.tv_sec = 0;
+        delay.tv_usec = interval * 1000;
+        select(0, NULL, NULL, NULL, &delay);
+        if (interval < 250)
+            interval = (interval * 2 > 250) ? 250 : interval * 2;
+    }
+    gettimeofday(&now, NULL);
+    *duration = (now.tv_sec - start.tv_sec) * 1000
+        + (now.tv_usec - start.tv_usec) / 1000;
+    if (result < 0) {
+        syswarn("cannot wait for %s", aklog);
+        return -1;
+    }
+    if (killed || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
 }
 
 
@@ -59,27 +131,32 @@ child_handler(int sig UNUSED)
 
 /*
  * This handler is installed for signals that should be propagated to the
- * child (and ignored by kstart).
+ * children (and ignored by kstart).  The signal is remembered so that the
+ * caller can tell why a child exited, and isn't sent to children that have
+ * already exited and been reaped.
  */
 static void
 propagate_handler(int sig)
 {
-    kill(global_child_pid, sig);
+    size_t i;
+
+    if (sig != SIGHUP)
+        global_stop = sig;
+    for (i = 0; i < nchildren; i++)
+        if (children[i].pid > 0) {
+            children[i].signal = sig;
+            kill(children[i].pid, sig);
+        }
 }
 
 
 /*
- * Start a command, returning its PID.  Takes the command to run, which will
- * be searched for on the path if not fully-qualified, and then the arguments
- * to pass to it.  If execution fails for some reason, returns -1.
- *
- * This function should only be called once before a call to finish_command;
- * otherwise, the signal handler code won't work properly.
+ * Install the signal handlers used while running a command.  Returns 0 on
+ * success and -1 on failure.
  */
-pid_t
-command_start(const char *command, char **argv)
+static int
+install_handlers(void)
 {
-    pid_t child;
     struct sigaction sa;
 
     memset(&sa, 0, sizeof(sa));
@@ -101,7 +178,57 @@ command_start(const char *command, char **argv)
         return -1;
     if (sigaction(SIGTERM, &sa, NULL) < 0)
         return -1;
+    return 0;
+}
+
+
+/*
+ * Remember a new child so that signals are propagated to it, reusing a free
+ * slot if there is one.  Signals are blocked while the table is resized so
+ * that the handler never sees it half-updated.
+ */
+static void
+add_child(pid_t child)
+{
+    sigset_t block, old;
+    size_t i;
+
+    for (i = 0; i < nchildren; i++)
+        if (children[i].pid == 0)
+            break;
+    if (i == nchildren) {
+        sigemptyset(&block);
+        sigaddset(&block, SIGHUP);
+        sigaddset(&block, SIGINT);
+        sigaddset(&block, SIGQUIT);
+        sigaddset(&block, SIGTERM);
+        sigprocmask(SIG_BLOCK, &block, &old);
+        children = xreallocarray(children, nchildren + 1,
+                                 sizeof(struct child));
+        children[nchildren].pid = 0;
+        nchildren++;
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    }
+    children[i].signal = 0;
+    children[i].pid = child;
+}
 
+
+/*
+ * Start a command, returning its PID.  Takes the command to run, which will
+ * be searched for on the path if not fully-qualified, and then the arguments
+ * to pass to it.  If execution fails for some reason, returns -1.
+ *
+ * This may be called several times to run several commands at once.  Signals
+ * we're asked to pass on are sent to all of them.
+ */
+pid_t
+command_start(const char *command, char **argv)
+{
+    pid_t child;
+
+    if (install_handlers() < 0)
+        return -1;
     child = fork();
     if (child < 0)
         return -1;
@@ -109,27 +236,62 @@ command_start(const char *command, char **argv)
         execvp(command, argv);
         return -1;
     } else {
-        global_child_pid = child;
+        add_child(child);
         return child;
     }
 }
 
 
 /*
- * Check to see if the given pid is finished.  If it is, put its exit status
- * into the second argument, if not NULL, and return 1.  Otherwise, return 0,
- * or -1 if waitpid failed.
+ * Take over an already running child process, such as one started by this
+ * process before it re-executed itself, as if it had been started with
+ * command_start.  Returns 0 on success and -1 on failure.
  */
 int
-command_finish(pid_t child, int *status)
+command_adopt(pid_t child)
+{
+    if (install_handlers() < 0)
+        return -1;
+    add_child(child);
+    return 0;
+}
+
+
+/*
+ * Check to see if the given pid is finished.  If it is, put its wait status
+ * into the second argument and the last signal propagated to it, or 0 if
+ * none, into the third argument, and return 1.  Otherwise, return 0, or -1
+ * if waitpid failed.  Once the child has been reaped, signals are no longer
+ * propagated to it.
+ */
+int
+command_finish(pid_t child, int *status, int *sig)
 {
     int result;
+    size_t i;
 
     result = waitpid(child, status, WNOHANG);
     if (result < 0)
         return -1;
     if (result == 0)
         return 0;
-    *status = WEXITSTATUS(*status);
+    *sig = 0;
+    for (i = 0; i < nchildren; i++)
+        if (children[i].pid == child) {
+            children[i].pid = 0;
+            *sig = children[i].signal;
+        }
     return 1;
 }
+
+
+/*
+ * Return the last SIGINT, SIGQUIT, or SIGTERM we received and passed on to
+ * our children, or 0 if we haven't received one.  Once one of these has been
+ * received, the children are expected to be stopping.
+ */
+int
+command_stopped(void)
+{
+    return global_stop;
+}
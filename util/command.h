@@ -24,25 +24,43 @@ BEGIN_DECLS
 #pragma GCC visibility push(hidden)
 
 /*
- * Run the given aklog command.  If verbose is true, print some more output to
- * standard output about the exit status.
+ * Run the given aklog command in its own process group, killing the group if
+ * it's still running after timeout seconds (unless timeout is 0).  Returns
+ * the exit status or -1 if it couldn't be run, died from a signal, or was
+ * killed, and stores how long it ran in milliseconds in duration.
  */
-void command_run(const char *aklog, bool verbose);
+int command_run(const char *aklog, unsigned int timeout,
+                unsigned long *duration)
+    __attribute__((__nonnull__));
 
 /*
  * Start a command, executing the given command with the given argument vector
  * (which includes argv[0]).  Returns the PID or -1 on error.  This function
- * should not be called again without an intervening finish_command or the
- * signal handling won't work properly.
+ * may be called several times to run several commands, and signals that we
+ * pass on are sent to all of them.
  */
 pid_t command_start(const char *command, char **argv);
 
 /*
- * Check to see if the given command has finished.  If so, return 1 and set
- * status to its exit status.  If it hasn't, return 0.  Return -1 on an
- * error.
+ * Take over an already running child process with the given PID, such as one
+ * started before the program re-executed itself, as if it had been started
+ * by command_start.  Returns 0 on success and -1 on error.
  */
-int command_finish(pid_t child, int *status);
+int command_adopt(pid_t child);
+
+/*
+ * Check to see if the given command has finished.  If so, return 1, set
+ * status to its wait status, suitable for WIFEXITED and the other wait
+ * macros, and set sig to the last signal passed on to it or 0.  If it
+ * hasn't, return 0.  Return -1 on an error.
+ */
+int command_finish(pid_t child, int *status, int *sig);
+
+/*
+ * Return the last SIGINT, SIGQUIT, or SIGTERM we received and passed on to
+ * the commands, or 0 if there hasn't been one.
+ */
+int command_stopped(void);
 
 /* Undo default visibility change. */
 #pragma GCC visibility pop